@@ -0,0 +1,166 @@
+/* Compositing kernel benchmark, run with 'make bench'.
+
+Times each of the specialized kernels that compose a decoded row onto the
+canvas against the generic per-pixel loop they replaced, on rows as wide as
+those of a large canvas, and checks that both give the same result. The
+library is included directly so that its static kernels can be called without
+going through the decoder. It comes first, as it sets the feature test
+macros. */
+
+#include "libgifsplit.c"
+
+#include <time.h>
+
+#define ROW_WIDTH 4000
+#define ROWS 20000
+
+/* Colors in the colormap; indices past it exercise the black fallback */
+#define MAP_COLORS 200
+
+/* Transparent runs of up to this many pixels, like the unchanged areas that
+animation optimizers leave in a frame */
+#define MAX_RUN 32
+
+enum {
+    MODE_COPY,
+    MODE_MERGE,
+    MODE_MERGE_TRUECOLOR,
+};
+
+/* How rows were composed before the kernels: a switch per row, and a test of
+the transparent index and the colormap size per pixel */
+static void compose_generic(const ComposeState *state, ColorMapObject *map,
+                            int mode, GifPixelType *q, const GifPixelType *p)
+{
+    GifWord transparent_color_index = state->TransparentColorIndex;
+
+    switch (mode) {
+    case MODE_COPY:
+        memcpy(q, p, state->Width);
+        break;
+    case MODE_MERGE:
+        for (int x = 0; x < state->Width; x++) {
+            if (*p != transparent_color_index)
+                *q = *p;
+            q++;
+            p++;
+        }
+        break;
+    case MODE_MERGE_TRUECOLOR:
+        for (int x = 0; x < state->Width; x++) {
+            if (*p != transparent_color_index) {
+                GifColorType color = {0,0,0};
+                if (*p < map->ColorCount)
+                    color = map->Colors[*p];
+                *q++ = color.Red;
+                *q++ = color.Green;
+                *q++ = color.Blue;
+                *q++ = 255;
+            } else {
+                q += 4;
+            }
+            p++;
+        }
+        break;
+    }
+}
+
+/* Called through a pointer, as the kernels are, so that the mode is not
+known at compile time */
+static void (*volatile generic)(const ComposeState *, ColorMapObject *, int,
+                                GifPixelType *, const GifPixelType *)
+    = compose_generic;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Random indices, with runs of the transparent index in between if there
+is one */
+static void fill_row(GifPixelType *p, int width, int transparent)
+{
+    int x = 0;
+    while (x < width) {
+        int run = 1 + rand() % MAX_RUN;
+        bool clear = transparent >= 0 && rand() % 2;
+        for (; run-- && x < width; x++) {
+            p[x] = rand() % 256;
+            if (clear)
+                p[x] = transparent;
+            else if (p[x] == transparent)
+                p[x]++;
+        }
+    }
+}
+
+static bool run_case(const char *name, bool truecolor, int transparent,
+                     ColorMapObject *map)
+{
+    ComposeState state;
+    int bpp = truecolor ? 4 : 1;
+    int mode = truecolor ? MODE_MERGE_TRUECOLOR
+               : transparent >= 0 ? MODE_MERGE : MODE_COPY;
+
+    GifPixelType *p = malloc(ROW_WIDTH);
+    GifPixelType *old = malloc(ROW_WIDTH * bpp);
+    GifPixelType *new = malloc(ROW_WIDTH * bpp);
+    if (!p || !old || !new) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    fill_row(p, ROW_WIDTH, transparent);
+    for (int i = 0; i < ROW_WIDTH * bpp; i++)
+        old[i] = new[i] = rand();
+
+    memset(&state, 0, sizeof(state));
+    state.Width = ROW_WIDTH;
+    state.TransparentColorIndex = transparent;
+    SetComposeKernel(&state, map, truecolor);
+
+    double start = now();
+    for (int i = 0; i < ROWS; i++)
+        generic(&state, map, mode, old, p);
+    double generic_time = now() - start;
+
+    start = now();
+    for (int i = 0; i < ROWS; i++)
+        state.Compose(&state, new, p);
+    double kernel_time = now() - start;
+
+    bool same = !memcmp(old, new, ROW_WIDTH * bpp);
+    printf("%-28s %8.1f %8.1f %7.2fx%s\n", name,
+           generic_time * 1e9 / ROWS, kernel_time * 1e9 / ROWS,
+           generic_time / kernel_time, same ? "" : "  MISMATCH");
+
+    free(p);
+    free(old);
+    free(new);
+    return same;
+}
+
+int main(void)
+{
+    GifColorType colors[MAP_COLORS];
+    ColorMapObject map = {
+        .ColorCount = MAP_COLORS,
+        .BitsPerPixel = 8,
+        .Colors = colors,
+    };
+    for (int i = 0; i < MAP_COLORS; i++) {
+        colors[i].Red = rand();
+        colors[i].Green = rand();
+        colors[i].Blue = rand();
+    }
+
+    printf("%d-pixel rows, ns per row:\n", ROW_WIDTH);
+    printf("%-28s %8s %8s %8s\n", "kernel", "generic", "kernel", "speedup");
+    bool ok = true;
+    ok &= run_case("ComposeIndexed", false, -1, &map);
+    ok &= run_case("ComposeIndexedTransparent", false, 7, &map);
+    ok &= run_case("ComposeTruecolor", true, -1, &map);
+    ok &= run_case("ComposeTruecolorTransparent", true, 7, &map);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#include "giflzw.h"
+#include <string.h>
+
+#define LZW_BITS 12
+#define NO_CODE -1
+
+static void NextRow(GifLZWDecoder *dec)
+{
+    dec->RowFunc(dec->RowCtx, dec->Row, dec->RowPtr);
+    dec->Col = 0;
+    if (dec->Interlace) {
+        dec->Row += InterlacedJumps[dec->Pass];
+        while (dec->Row >= dec->Height) {
+            if (++dec->Pass >= 4) {
+                dec->Done = true;
+                return;
+            }
+            dec->Row = InterlacedOffset[dec->Pass];
+        }
+    } else if (++dec->Row >= dec->Height) {
+        dec->Done = true;
+    }
+}
+
+static void ResetTable(GifLZWDecoder *dec)
+{
+    dec->RunningCode = dec->EOFCode + 1;
+    dec->RunningBits = dec->CodeSize + 1;
+    dec->MaxCode1 = 1 << dec->RunningBits;
+    dec->FreeCode = dec->EOFCode + 1;
+    dec->LastCode = NO_CODE;
+}
+
+bool GifLZWInit(GifLZWDecoder *dec, int code_size, int width, int height,
+                bool interlace, GifPixelType *row_buf, GifLZWRowFunc row_func,
+                void *ctx)
+{
+    if (code_size < 0 || code_size > 8)
+        return false;
+
+    dec->RowPtr = row_buf;
+    dec->RowFunc = row_func;
+    dec->RowCtx = ctx;
+    dec->Width = width;
+    dec->Height = height;
+    dec->Interlace = interlace;
+    dec->Pass = 0;
+    dec->Row = 0;
+    dec->Col = 0;
+    dec->Done = width <= 0 || height <= 0;
+
+    dec->BitBuf = 0;
+    dec->BitCount = 0;
+
+    dec->CodeSize = code_size;
+    dec->ClearCode = 1 << code_size;
+    dec->EOFCode = dec->ClearCode + 1;
+    ResetTable(dec);
+
+    /* Literal codes never change, so only set them up once per image */
+    for (int i = 0; i < dec->ClearCode; i++) {
+        dec->Tail[i][0] = i;
+        dec->Skip[i] = 0;
+        dec->First[i] = i;
+        dec->Length[i] = 1;
+    }
+    return true;
+}
+
+/* Write the len byte string of a code back to front, ending just before end:
+ * its partial last chunk first, then every whole chunk before it. */
+static void ExpandCode(GifLZWDecoder *dec, int code, int len,
+                       GifPixelType *end)
+{
+    int tail = (len - 1) % GIF_LZW_CHUNK + 1;
+
+    end -= tail;
+    memcpy(end, dec->Tail[code], tail);
+    for (len -= tail; len; len -= GIF_LZW_CHUNK) {
+        code = dec->Skip[code];
+        end -= GIF_LZW_CHUNK;
+        memcpy(end, dec->Tail[code], GIF_LZW_CHUNK);
+    }
+}
+
+/* Write out the string for a (known valid) code */
+static void EmitCode(GifLZWDecoder *dec, int code)
+{
+    int len = dec->Length[code];
+
+    if (len == 1) {
+        dec->RowPtr[dec->Col] = dec->Tail[code][0];
+        if (++dec->Col == dec->Width)
+            NextRow(dec);
+        return;
+    }
+
+    if (len <= dec->Width - dec->Col) {
+        /* Fits in the current row: write it in place */
+        dec->Col += len;
+        ExpandCode(dec, code, len, dec->RowPtr + dec->Col);
+        if (dec->Col == dec->Width)
+            NextRow(dec);
+        return;
+    }
+
+    /* Straddles one or more rows: expand it first, then copy it out */
+    GifPixelType *s = dec->Stack;
+    ExpandCode(dec, code, len, s + len);
+    while (len && !dec->Done) {
+        int n = dec->Width - dec->Col;
+        if (n > len)
+            n = len;
+        memcpy(dec->RowPtr + dec->Col, s, n);
+        s += n;
+        len -= n;
+        dec->Col += n;
+        if (dec->Col == dec->Width)
+            NextRow(dec);
+    }
+}
+
+/* Process a single code. Returns false if the stream is corrupt. */
+static bool DecodeCode(GifLZWDecoder *dec, int code)
+{
+    /* Code width bookkeeping matches giflib, including for the degenerate
+       code sizes below 2 */
+    if (dec->RunningCode < GIF_LZW_MAX_CODE + 2
+        && ++dec->RunningCode > dec->MaxCode1
+        && dec->RunningBits < LZW_BITS) {
+        dec->MaxCode1 <<= 1;
+        dec->RunningBits++;
+    }
+
+    if (code == dec->ClearCode) {
+        ResetTable(dec);
+        return true;
+    }
+    /* End of data before the last pixel */
+    if (code == dec->EOFCode)
+        return false;
+
+    bool known = code < dec->ClearCode
+                 || (code > dec->EOFCode && code < dec->FreeCode);
+
+    /* The only unknown code allowed is the one about to be added, whose
+       string is the previous string plus its own first character. */
+    if (!known && (code != dec->FreeCode || dec->LastCode == NO_CODE))
+        return false;
+
+    /* The new string is the previous one plus one byte, which either goes
+       into a copy of its partial last chunk, or starts a new chunk after it */
+    if (dec->LastCode != NO_CODE && dec->FreeCode <= GIF_LZW_MAX_CODE) {
+        int last = dec->LastCode;
+        int slot = dec->FreeCode++;
+        int used = dec->Length[last] % GIF_LZW_CHUNK;
+        if (used) {
+            memcpy(dec->Tail[slot], dec->Tail[last], GIF_LZW_CHUNK);
+            dec->Skip[slot] = dec->Skip[last];
+        } else {
+            dec->Skip[slot] = last;
+        }
+        dec->Tail[slot][used] = known ? dec->First[code] : dec->First[last];
+        dec->First[slot] = dec->First[last];
+        dec->Length[slot] = dec->Length[last] + 1;
+    }
+
+    EmitCode(dec, code);
+    dec->LastCode = code;
+    return true;
+}
+
+bool GifLZWDecode(GifLZWDecoder *dec, const GifByteType *data, int len)
+{
+    const GifByteType *end = data + len;
+
+    while (!dec->Done) {
+        /* Top up the bit buffer, then drain as many codes as it holds */
+        while (dec->BitCount <= 56 && data < end) {
+            dec->BitBuf |= (uint64_t)*data++ << dec->BitCount;
+            dec->BitCount += 8;
+        }
+        if (dec->BitCount < dec->RunningBits)
+            return true;
+
+        while (dec->BitCount >= dec->RunningBits && !dec->Done) {
+            int bits = dec->RunningBits;
+            int code = dec->BitBuf & ((1 << bits) - 1);
+            dec->BitBuf >>= bits;
+            dec->BitCount -= bits;
+            if (!DecodeCode(dec, code))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool GifLZWFinished(GifLZWDecoder *dec)
+{
+    return dec->Done;
+}
@@ -0,0 +1,88 @@
+#ifndef GIFLZW_H
+#define GIFLZW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gif_lib.h>
+
+#define GIF_LZW_MAX_CODE 4095   /* Largest code representable in 12 bits */
+#define GIF_LZW_CHUNK 8         /* Bytes of a string written out per step */
+
+/* Row order of interlaced images: pass i starts at row InterlacedOffset[i]
+ * and advances by InterlacedJumps[i] rows. */
+static const int InterlacedOffset[] = { 0, 4, 2, 1 };
+static const int InterlacedJumps[] = { 8, 8, 4, 2 };
+
+/*
+ * Built-in LZW decoder for GIF image data.
+ *
+ * This replaces the per-line DGifGetLine() interface with a decoder that is
+ * fed the raw image data sub-blocks (as returned by DGifGetCode() and
+ * DGifGetCodeNext()) and writes pixels straight into a row buffer, handing
+ * each row over to a callback as soon as it is complete. Rows are numbered
+ * in image order, so interlaced images produce rows out of order. Its
+ * behavior on valid and invalid streams mirrors giflib's.
+ */
+typedef void (*GifLZWRowFunc)(void *ctx, int row, GifPixelType *data);
+
+typedef struct GifLZWDecoder_t {
+    /* Destination */
+    GifPixelType *RowPtr;       /* Row buffer, Width pixels */
+    GifLZWRowFunc RowFunc;      /* Called for every completed row */
+    void *RowCtx;
+    int Width, Height;
+    bool Interlace;
+    int Pass, Row, Col;         /* Current output position */
+    bool Done;                  /* All pixels have been written */
+
+    /* Bit reader: holds up to 64 bits so that several codes can be
+       extracted for every refill. */
+    uint64_t BitBuf;
+    int BitCount;
+
+    /* Code state, named after the giflib equivalents */
+    int CodeSize, ClearCode, EOFCode;
+    int RunningCode, RunningBits, MaxCode1;
+    int FreeCode;               /* Next code to be added to the table */
+    int LastCode;               /* Previous code, or -1 after a clear */
+
+    /* String table, split into chunks of GIF_LZW_CHUNK bytes counted from
+       the start of the string. Tail holds the last chunk of a code's string,
+       which may be partial, and Skip the code whose string is everything
+       before it, so a string is written out back to front directly into the
+       row a whole chunk at a time rather than a byte at a time. Length and
+       First complete the entry. */
+    uint8_t Tail[GIF_LZW_MAX_CODE + 1][GIF_LZW_CHUNK];
+    uint16_t Skip[GIF_LZW_MAX_CODE + 1];
+    uint16_t Length[GIF_LZW_MAX_CODE + 1];
+    uint8_t First[GIF_LZW_MAX_CODE + 1];
+
+    /* Scratch space for strings that straddle a row boundary */
+    GifPixelType Stack[GIF_LZW_MAX_CODE + 1];
+} GifLZWDecoder;
+
+/*
+ * Prepare the decoder for an image.
+ *
+ * code_size is the LZW minimum code size as returned by DGifGetCode(), and
+ * row_buf must have room for width pixels. row_func is called with ctx and
+ * row_buf once per row. Returns false if the code size is invalid.
+ */
+bool GifLZWInit(GifLZWDecoder *dec, int code_size, int width, int height,
+                bool interlace, GifPixelType *row_buf, GifLZWRowFunc row_func,
+                void *ctx);
+
+/*
+ * Decode one image data sub-block of len bytes.
+ *
+ * Data following the last pixel is ignored. Returns false if the stream is
+ * corrupt.
+ */
+bool GifLZWDecode(GifLZWDecoder *dec, const GifByteType *data, int len);
+
+/*
+ * Check that the image is complete after the last sub-block has been fed.
+ */
+bool GifLZWFinished(GifLZWDecoder *dec);
+
+#endif
@@ -7,24 +7,49 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <png.h>
 #include <jpeglib.h>
 #include "libgifsplit.h"
+#include "writer.h"
+#include "pngpar.h"
 
 #define ERR_UNSPECIFIED     1
 #define ERR_MAX_FRAMES      2
 #define ERR_MAX_SIZE        3
 #define ERR_MAX_FRAME_SIZE  4
 
+#define RAW_NONE    0
+#define RAW_RGBA    1
+#define RAW_Y4M     2
+
+/* Smallest frame, in pixels, that -p compresses with several threads */
+#define PARALLEL_PNG_MIN_PIXELS (1 << 20)
+
 int verbose = 0;
 bool jpeg = false;
+int raw = RAW_NONE;
+const char *info_filename = NULL;
+const char *timestamps_filename = NULL;
+uint8_t background[3] = {255, 255, 255};
 bool optimize = false;
+bool builtin_lzw = false;
+long max_pixels = 0;
+const char *spill_dir = NULL;
 int quality = 0;
 int sampling = -1;
 int max_frames = 0;
 long max_size = 0;
 long max_frame_size = 0;
+int writer_threads = 0;
+writer *output_writer = NULL;
+int jobs = 0;
+int png_threads = 0;
+int crop_left = 0, crop_top = 0, crop_width = 0, crop_height = 0;
+int sprite_columns = -1;
+int sprite_scale = 1;
+bool sprite_dedup = false;
 
 static void usage(const char *argv0)
 {
@@ -41,9 +66,36 @@ static void usage(const char *argv0)
     fprintf(stderr, "                   2: 4:2:0 (2x2 subsampling)\n");
     fprintf(stderr, "                 default: 2 for q<90, else 0\n");
     fprintf(stderr, "  -o             optimize the JPEG Huffman tables\n");
+    fprintf(stderr, "  -r FORMAT      write all frames as raw video to output_base\n");
+    fprintf(stderr, "                 ('-' for stdout) instead of images:\n");
+    fprintf(stderr, "                   rgba: raw RGBA pixels\n");
+    fprintf(stderr, "                   y4m: YUV4MPEG2, 4:2:0\n");
+    fprintf(stderr, "  -b RRGGBB      background color for transparent pixels\n");
+    fprintf(stderr, "                 in JPEG and y4m output (default ffffff)\n");
+    fprintf(stderr, "  -d FILE        write frame info to FILE instead of stdout\n");
+    fprintf(stderr, "                 (default stderr when writing video to stdout)\n");
+    fprintf(stderr, "  -T FILE        with -r, write frame timestamps to FILE in\n");
+    fprintf(stderr, "                 mkvmerge timestamp format v2\n");
     fprintf(stderr, "  -m [COUNT]     max number of frames to output\n");
     fprintf(stderr, "  -M [BYTES]     max cumulative output size\n");
     fprintf(stderr, "  -F [BYTES]     max frame output size\n");
+    fprintf(stderr, "  -l             use the built-in LZW decoder\n");
+    fprintf(stderr, "  -P [PIXELS]    max canvas size (default %d)\n",
+            GIF_SPLIT_DEFAULT_MAX_PIXELS);
+    fprintf(stderr, "  -t [DIR]       keep large canvases in temporary files\n");
+    fprintf(stderr, "                 in DIR instead of memory\n");
+    fprintf(stderr, "  -w [THREADS]   write output files in the background, via\n");
+    fprintf(stderr, "                 io_uring if available, else with THREADS threads\n");
+    fprintf(stderr, "  -j [JOBS]      split the animation at keyframes and process the\n");
+    fprintf(stderr, "                 parts with JOBS threads (ignored with -r)\n");
+    fprintf(stderr, "  -p [THREADS]   compress PNG frames of a megapixel or more with\n");
+    fprintf(stderr, "                 THREADS threads each\n");
+    fprintf(stderr, "  -c X,Y,W,H     only output the WxH rectangle at X,Y of each frame\n");
+    fprintf(stderr, "  -g COLUMNS     pack the frames into sprite sheets with COLUMNS\n");
+    fprintf(stderr, "                 frames per row (0: automatic), and output a\n");
+    fprintf(stderr, "                 JSON manifest instead of the frame info\n");
+    fprintf(stderr, "  -z SCALE       downsample sprite sheet frames by SCALE\n");
+    fprintf(stderr, "  -u             store repeated frames only once in sprite sheets\n");
 }
 
 static void dbgprintf(const char *fmt, ...) {
@@ -57,177 +109,1459 @@ static void dbgprintf(const char *fmt, ...) {
     va_end(ap);
 }
 
-static long write_jpeg(GifSplitImage *img, const char *filename)
-{
-    long size;
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    int row_stride = img->Width * 3;
+/* The last encoded frame, kept so that it can be written again for frames
+that did not change */
+typedef struct {
+    void *data;
+    size_t size;
+} encoded_frame;
 
-    JSAMPROW row_pointer[1];
-    JSAMPLE *row = malloc(row_stride);
-    if (!row) {
-        fprintf(stderr, "Out of memory\n");
-        return -1;
+/* Hand an encoded frame over to the writer, keeping a copy in last if
+given */
+static long submit_frame(const char *filename, void *data, size_t size,
+                         encoded_frame *last)
+{
+    if (last) {
+        free(last->data);
+        last->data = malloc(size);
+        last->size = size;
+        if (last->data)
+            memcpy(last->data, data, size);
     }
-    row_pointer[0] = row;
-
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
+    if (!writer_submit(output_writer, filename, data, size))
         return -1;
-    }
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, fp);
-
-    assert(img->IsTruecolor);
+    return size;
+}
 
-    cinfo.image_width = img->Width;
-    cinfo.image_height = img->Height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    cinfo.optimize_coding = optimize;
-    cinfo.dct_method = JDCT_ISLOW;
+/* Set the compression parameters for an RGB image from the options. The
+image size is left to the caller. */
+static void setup_jpeg(struct jpeg_compress_struct *cinfo)
+{
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    cinfo->optimize_coding = optimize;
+    cinfo->dct_method = JDCT_ISLOW;
 
     /* Counter-intuitively, chroma sampling is specified relative to luma
     sampling, so we change the luma factors only (oversampling relative to
     chroma). */
-    cinfo.comp_info[1].v_samp_factor = 1;
-    cinfo.comp_info[1].h_samp_factor = 1;
-    cinfo.comp_info[2].v_samp_factor = 1;
-    cinfo.comp_info[2].h_samp_factor = 1;
-
-    if (sampling < 0 || sampling > 2) {
-        sampling = quality < 90 ? 2 : 0;
-    }
+    cinfo->comp_info[1].v_samp_factor = 1;
+    cinfo->comp_info[1].h_samp_factor = 1;
+    cinfo->comp_info[2].v_samp_factor = 1;
+    cinfo->comp_info[2].h_samp_factor = 1;
 
     switch (sampling) {
         case 1:
-            cinfo.comp_info[0].v_samp_factor = 1;
-            cinfo.comp_info[0].h_samp_factor = 2;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            cinfo->comp_info[0].h_samp_factor = 2;
             break;
         case 2:
-            cinfo.comp_info[0].v_samp_factor = 2;
-            cinfo.comp_info[0].h_samp_factor = 2;
+            cinfo->comp_info[0].v_samp_factor = 2;
+            cinfo->comp_info[0].h_samp_factor = 2;
             break;
         default:
-            cinfo.comp_info[0].v_samp_factor = 1;
-            cinfo.comp_info[0].h_samp_factor = 1;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            cinfo->comp_info[0].h_samp_factor = 1;
             break;
     }
+}
+
+/* Encoding state that is set up once and reused for every frame, rather than
+being rebuilt each time. Every thread that encodes frames has its own. */
+typedef struct {
+    /* The JPEG compressor, with the parameters and quantization tables
+    derived from the options, and its row buffer */
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPLE *row;
+    size_t row_size;
+
+    uint8_t *palette_row;       /* One row of exact palette indices */
+    size_t palette_row_size;
+} encoder;
+
+static encoder *encoder_open(void)
+{
+    encoder *enc = calloc(1, sizeof(encoder));
+    if (!enc)
+        return NULL;
+
+    if (jpeg) {
+        enc->cinfo.err = jpeg_std_error(&enc->jerr);
+        jpeg_create_compress(&enc->cinfo);
+        setup_jpeg(&enc->cinfo);
+    }
+    return enc;
+}
+
+static void encoder_close(encoder *enc)
+{
+    if (!enc)
+        return;
+    if (jpeg)
+        jpeg_destroy_compress(&enc->cinfo);
+    free(enc->row);
+    free(enc->palette_row);
+    free(enc);
+}
+
+/* Get a JPEG row buffer of at least size bytes */
+static JSAMPLE *encoder_jpeg_row(encoder *enc, size_t size)
+{
+    if (enc->row_size < size) {
+        free(enc->row);
+        enc->row = malloc(size);
+        enc->row_size = enc->row ? size : 0;
+        if (!enc->row)
+            fprintf(stderr, "Out of memory\n");
+    }
+    return enc->row;
+}
+
+static long write_jpeg(encoder *enc, GifSplitImage *img, const char *filename,
+                       encoded_frame *last)
+{
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
+    size_t row_stride = img->Width * 3;
+
+    JSAMPROW row_pointer[1];
+    JSAMPLE *row = encoder_jpeg_row(enc, row_stride);
+    if (!row)
+        return -1;
+    row_pointer[0] = row;
+
+    unsigned char *buf = NULL;
+    unsigned long buf_size = 0;
+
+    /* Only the destination and the image size change between frames */
+    jpeg_mem_dest(cinfo, &buf, &buf_size);
+
+    assert(img->IsTruecolor);
 
-    jpeg_start_compress(&cinfo, TRUE);
+    cinfo->image_width = img->Width;
+    cinfo->image_height = img->Height;
+    jpeg_start_compress(cinfo, TRUE);
 
     uint8_t *p = img->RasterData;
-    while (cinfo.next_scanline < cinfo.image_height) {
-        int i;
-        for (i = 0; i < row_stride; i += 3) {
-            /* Convert transparent pixels to white */
-            row[i + 0] = p[3] ? p[0] : 255;
-            row[i + 1] = p[3] ? p[1] : 255;
-            row[i + 2] = p[3] ? p[2] : 255;
+    while (cinfo->next_scanline < cinfo->image_height) {
+        for (size_t i = 0; i < row_stride; i += 3) {
+            /* Convert transparent pixels to the background color */
+            row[i + 0] = p[3] ? p[0] : background[0];
+            row[i + 1] = p[3] ? p[1] : background[1];
+            row[i + 2] = p[3] ? p[2] : background[2];
             p += 4;
         }
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        jpeg_write_scanlines(cinfo, row_pointer, 1);
     }
 
-    jpeg_finish_compress(&cinfo);
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fclose(fp);
-    jpeg_destroy_compress(&cinfo);
-    free(row);
-    return size;
+    jpeg_finish_compress(cinfo);
+
+    return submit_frame(filename, buf, buf_size, last);
 }
 
-static long write_png(GifSplitImage *img, const char *filename)
+/* Open-addressing hash table for counting colors; twice the largest number of
+colors that can go in a palette, to keep probe sequences short */
+#define PALETTE_HASH_BITS 9
+#define PALETTE_HASH_SIZE (1 << PALETTE_HASH_BITS)
+
+typedef struct {
+    png_color colors[256];
+    png_byte alpha[256];
+    int count;
+    int trans_count;            /* Number of tRNS entries needed */
+    const GifSplitImage *img;
+    uint32_t keys[PALETTE_HASH_SIZE];
+    int16_t slots[PALETTE_HASH_SIZE];   /* Palette index of each key, or -1 */
+} exact_palette;
+
+/* Truecolor alpha is always either 0 or 255, and all fully transparent pixels
+are treated as the same color */
+static inline uint32_t palette_key(const uint8_t *p)
 {
-    long size;
-    png_bytepp row_pointers;
+    return p[3] ? p[0] | (p[1] << 8) | (p[2] << 16) | 0xff000000u : 0;
+}
 
-    row_pointers = malloc(sizeof(*row_pointers) * img->Height);
-    if (!row_pointers) {
-        fprintf(stderr, "Out of memory\n");
-        return -1;
+/* Find the hash table slot of a color, or the empty slot where it goes */
+static inline int palette_slot(const exact_palette *pal, uint32_t key)
+{
+    uint32_t h = (key * 0x9e3779b1u) >> (32 - PALETTE_HASH_BITS);
+    while (pal->slots[h] >= 0 && pal->keys[h] != key)
+        h = (h + 1) & (PALETTE_HASH_SIZE - 1);
+    return h;
+}
+
+/* Check whether a truecolor image has at most 256 distinct colors, and if so,
+build a palette for it. The pixels are mapped to it a row at a time by
+exact_palette_row, so that no index buffer the size of the image is needed. */
+static bool find_exact_palette(GifSplitImage *img, exact_palette *pal)
+{
+    size_t pixels = (size_t)img->Width * img->Height;
+
+    assert(img->IsTruecolor);
+
+    memset(pal->slots, -1, sizeof(pal->slots));
+    pal->count = 0;
+    pal->trans_count = 0;
+    pal->img = img;
+
+    const uint8_t *p = img->RasterData;
+    uint32_t last_key = 0;
+    bool have_last = false;
+    for (size_t i = 0; i < pixels; i++, p += 4) {
+        uint32_t key = palette_key(p);
+
+        /* Runs of the same color are common, so skip the lookup for them */
+        if (key == last_key && have_last)
+            continue;
+        int h = palette_slot(pal, key);
+        if (pal->slots[h] < 0) {
+            if (pal->count == 256)
+                return false;
+            pal->keys[h] = key;
+            pal->slots[h] = pal->count;
+            pal->colors[pal->count].red = key;
+            pal->colors[pal->count].green = key >> 8;
+            pal->colors[pal->count].blue = key >> 16;
+            pal->alpha[pal->count] = key >> 24;
+            if (!(key >> 24))
+                pal->trans_count = pal->count + 1;
+            pal->count++;
+        }
+        last_key = key;
+        have_last = true;
     }
+    return true;
+}
 
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        return -1;
+/* Map row y of the image to palette indices. Only reads the palette, so the
+threads of the parallel PNG encoder can call it at the same time. */
+static void exact_palette_row(const void *ctx, int y, uint8_t *out)
+{
+    const exact_palette *pal = ctx;
+    const uint8_t *p = pal->img->RasterData + (size_t)y * pal->img->Width * 4;
+    uint32_t last_key = 0;
+    int last_index = -1;
+
+    for (int x = 0; x < pal->img->Width; x++, p += 4) {
+        uint32_t key = palette_key(p);
+        if (key != last_key || last_index < 0) {
+            last_key = key;
+            last_index = pal->slots[palette_slot(pal, key)];
+        }
+        out[x] = last_index;
+    }
+}
+
+/* Growable memory buffer that libpng writes the encoded image into */
+typedef struct {
+    png_bytep data;
+    size_t size;
+    size_t alloc;
+} png_buffer;
+
+static void png_buffer_write(png_structp png_ptr, png_bytep data,
+                             png_size_t length)
+{
+    png_buffer *buf = png_get_io_ptr(png_ptr);
+
+    if (buf->size + length > buf->alloc) {
+        size_t alloc = buf->alloc ? buf->alloc : 65536;
+        while (alloc < buf->size + length)
+            alloc *= 2;
+        png_bytep p = realloc(buf->data, alloc);
+        if (!p)
+            png_error(png_ptr, "Out of memory");
+        buf->data = p;
+        buf->alloc = alloc;
+    }
+    memcpy(buf->data + buf->size, data, length);
+    buf->size += length;
+}
+
+static void png_buffer_flush(png_structp png_ptr)
+{
+    (void)png_ptr;
+}
+
+static long write_png(encoder *enc, GifSplitImage *img, const char *filename,
+                      encoded_frame *last)
+{
+    exact_palette pal;
+    bool exact = img->IsTruecolor && find_exact_palette(img, &pal);
+    png_buffer buf = {NULL, 0, 0};
+    png_byte trans_alpha[256];
+
+    if (exact)
+        dbgprintf("Writing truecolor frame with %d colors as palette\n",
+                  pal.count);
+
+    /* Work out the PNG format first, for either encoder */
+    pngpar_image desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.width = img->Width;
+    desc.height = img->Height;
+    if (exact) {
+        int bpp = 1;
+        while ((1 << bpp) < pal.count)
+            bpp <<= 1;
+        desc.bit_depth = bpp;
+        desc.palette = true;
+        desc.colors = (const uint8_t *)pal.colors;
+        desc.color_count = pal.count;
+        if (pal.trans_count) {
+            desc.alpha = pal.alpha;
+            desc.alpha_count = pal.trans_count;
+        }
+        desc.read_row = exact_palette_row;
+        desc.row_ctx = &pal;
+    } else if (img->IsTruecolor) {
+        desc.bit_depth = 8;
+        desc.pixels = img->RasterData;
+        desc.stride = 4 * img->Width;
+    } else {
+        assert(img->ColorMap);
+        int bpp = img->ColorMap->BitsPerPixel;
+        /* Round to next power of two */
+        while (bpp & (bpp - 1))
+            bpp++;
+        desc.bit_depth = bpp;
+        desc.palette = true;
+        /* GifColorType should have the same layout as png_color */
+        desc.colors = (const uint8_t *)img->ColorMap->Colors;
+        desc.color_count = img->ColorMap->ColorCount;
+        if (img->TransparentColorIndex != -1) {
+            memset(trans_alpha, 255, img->TransparentColorIndex);
+            trans_alpha[img->TransparentColorIndex] = 0;
+            desc.alpha = trans_alpha;
+            desc.alpha_count = img->TransparentColorIndex + 1;
+        }
+        desc.pixels = img->RasterData;
+        desc.stride = img->Width;
+    }
+
+    if (png_threads > 1
+        && (size_t)img->Width * img->Height >= PARALLEL_PNG_MIN_PIXELS) {
+        void *data;
+        size_t size;
+        dbgprintf("Compressing frame with %d threads\n", png_threads);
+        if (!pngpar_encode(&desc, png_threads, &data, &size)) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        return submit_frame(filename, data, size, last);
+    }
+
+    if (desc.read_row && enc->palette_row_size < (size_t)img->Width) {
+        free(enc->palette_row);
+        enc->palette_row = malloc(img->Width);
+        enc->palette_row_size = enc->palette_row ? img->Width : 0;
+        if (!enc->palette_row) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
     }
 
     png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
                                                   NULL, NULL, NULL);
-    if (!png_ptr)
+    if (!png_ptr) {
+        fprintf(stderr, "Out of memory\n");
+        free(buf.data);
         return -1;
+    }
 
     png_infop info_ptr = png_create_info_struct(png_ptr);
     if (!info_ptr) {
+        fprintf(stderr, "Out of memory\n");
         png_destroy_write_struct(&png_ptr, NULL);
+        free(buf.data);
         return -1;
     }
 
     if (setjmp(png_jmpbuf(png_ptr))) {
         fprintf(stderr, "libpng returned an error\n");
         png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(buf.data);
+        return -1;
+    }
+    png_set_write_fn(png_ptr, &buf, png_buffer_write, png_buffer_flush);
+
+    png_set_IHDR(png_ptr, info_ptr, desc.width, desc.height, desc.bit_depth,
+                 desc.palette ? PNG_COLOR_TYPE_PALETTE
+                              : PNG_COLOR_TYPE_RGB_ALPHA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    if (desc.palette)
+        png_set_PLTE(png_ptr, info_ptr, (png_colorp)desc.colors,
+                     desc.color_count);
+    if (desc.alpha)
+        png_set_tRNS(png_ptr, info_ptr, (png_bytep)desc.alpha,
+                     desc.alpha_count, NULL);
+
+    png_write_info(png_ptr, info_ptr);
+    if (desc.palette)
+        png_set_packing(png_ptr);
+
+    /* Stream the rows out one at a time, rather than handing libpng the whole
+    image, so that a canvas that lives in a temporary file is read in order */
+    for (int i = 0; i < img->Height; i++) {
+        if (desc.read_row) {
+            desc.read_row(desc.row_ctx, i, enc->palette_row);
+            png_write_row(png_ptr, enc->palette_row);
+        } else {
+            png_write_row(png_ptr, (png_bytep)desc.pixels + i * desc.stride);
+        }
+    }
+    png_write_end(png_ptr, info_ptr);
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    return submit_frame(filename, buf.data, buf.size, last);
+}
+
+/* Write a frame as a PNG or JPEG. If last is given, frames that are known not
+to have changed are written as a copy of the last frame instead of being
+encoded again, which is common when cropping out a small part of the
+animation. */
+static long write_frame(encoder *enc, GifSplitImage *img,
+                        const char *filename, encoded_frame *last)
+{
+    if (last && last->data && img->Unchanged) {
+        dbgprintf("Frame unchanged, reusing the last one\n");
+        void *data = malloc(last->size);
+        if (!data) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        memcpy(data, last->data, last->size);
+        if (!writer_submit(output_writer, filename, data, last->size))
+            return -1;
+        return last->size;
+    }
+    if (jpeg)
+        return write_jpeg(enc, img, filename, last);
+    return write_png(enc, img, filename, last);
+}
+
+static long write_rgba(GifSplitImage *img, FILE *fp)
+{
+    size_t size = (size_t)img->Width * img->Height * 4;
+
+    assert(img->IsTruecolor);
+
+    if (fwrite(img->RasterData, 1, size, fp) != size)
+        return -1;
+    return size;
+}
+
+/* Composite a truecolor pixel onto the background color, which is expected
+in a local array bg. Truecolor alpha is always either 0 or 255, so it can be
+used directly as a mask. */
+#define BLEND(p, c) (((p)[c] & (p)[3]) | (bg[c] & ~(p)[3]))
+
+/* BT.601 limited range */
+#define RGB_TO_Y(r, g, b) ((((66 * (r) + 129 * (g) + 25 * (b)) + 128) >> 8) + 16)
+#define RGB_TO_U(r, g, b) ((((-38 * (r) - 74 * (g) + 112 * (b)) + 128) >> 8) + 128)
+#define RGB_TO_V(r, g, b) ((((112 * (r) - 94 * (g) - 18 * (b)) + 128) >> 8) + 128)
+
+/* Pixels converted per block. GCC at -O2 only vectorizes loops whose trip
+count is a known multiple of the vector width, so the rows are done in blocks
+of this many, with plain loops for what is left at the end. */
+#define YUV_BLOCK 32
+
+static inline void rgba_to_luma(const uint8_t *row, const uint8_t *bg, int n,
+                                uint8_t *restrict out)
+{
+    for (int x = 0; x < n; x++) {
+        const uint8_t *p = row + 4 * x;
+        out[x] = RGB_TO_Y(BLEND(p, 0), BLEND(p, 1), BLEND(p, 2));
+    }
+}
+
+/* Average 2x2 pixels into each of n chroma samples */
+static inline void rgba_to_chroma(const uint8_t *row0, const uint8_t *row1,
+                                  const uint8_t *bg, int n,
+                                  uint8_t *restrict u, uint8_t *restrict v)
+{
+    for (int x = 0; x < n; x++) {
+        const uint8_t *p = row0 + 8 * x;
+        const uint8_t *q = row1 + 8 * x;
+        int r = BLEND(p, 0) + BLEND(p + 4, 0) + BLEND(q, 0) + BLEND(q + 4, 0);
+        int g = BLEND(p, 1) + BLEND(p + 4, 1) + BLEND(q, 1) + BLEND(q + 4, 1);
+        int b = BLEND(p, 2) + BLEND(p + 4, 2) + BLEND(q, 2) + BLEND(q + 4, 2);
+        r = (r + 2) >> 2;
+        g = (g + 2) >> 2;
+        b = (b + 2) >> 2;
+        u[x] = RGB_TO_U(r, g, b);
+        v[x] = RGB_TO_V(r, g, b);
+    }
+}
+
+/* Convert two rows of RGBA pixels to two rows of luma and one row of 2x2
+subsampled chroma. The loops are kept free of branches so that the compiler
+can vectorize them. The outputs must not overlap each other or the inputs,
+and the background is copied into locals, or else the compiler has to assume
+that every store may change what the next pixel reads. */
+static void rgba_to_yuv420(const uint8_t *row0, const uint8_t *row1, int width,
+                           uint8_t *restrict y0, uint8_t *restrict y1,
+                           uint8_t *restrict u, uint8_t *restrict v)
+{
+    const uint8_t bg[3] = { background[0], background[1], background[2] };
+
+    int x = 0;
+    for (; x + YUV_BLOCK <= width; x += YUV_BLOCK) {
+        rgba_to_luma(row0 + 4 * x, bg, YUV_BLOCK, y0 + x);
+        rgba_to_luma(row1 + 4 * x, bg, YUV_BLOCK, y1 + x);
+    }
+    rgba_to_luma(row0 + 4 * x, bg, width - x, y0 + x);
+    rgba_to_luma(row1 + 4 * x, bg, width - x, y1 + x);
+
+    int half = width / 2;
+    for (x = 0; x + YUV_BLOCK <= half; x += YUV_BLOCK)
+        rgba_to_chroma(row0 + 8 * x, row1 + 8 * x, bg, YUV_BLOCK, u + x, v + x);
+    rgba_to_chroma(row0 + 8 * x, row1 + 8 * x, bg, half - x, u + x, v + x);
+
+    if (width & 1) {
+        const uint8_t *p = row0 + 8 * half;
+        const uint8_t *q = row1 + 8 * half;
+        int r = (BLEND(p, 0) + BLEND(q, 0) + 1) >> 1;
+        int g = (BLEND(p, 1) + BLEND(q, 1) + 1) >> 1;
+        int b = (BLEND(p, 2) + BLEND(q, 2) + 1) >> 1;
+        u[half] = RGB_TO_U(r, g, b);
+        v[half] = RGB_TO_V(r, g, b);
+    }
+}
+
+/* Write a frame as YUV4MPEG2, converting it into *buf, which is allocated on
+the first frame and is up to the caller to free */
+static long write_y4m(GifSplitImage *img, FILE *fp, uint8_t **buf)
+{
+    uint8_t *yuv = *buf;
+    long size = 0;
+    int width = img->Width, height = img->Height;
+    int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    size_t luma_size = (size_t)width * height;
+    size_t chroma_size = (size_t)chroma_width * chroma_height;
+    size_t stride = 4 * (size_t)width;
+
+    assert(img->IsTruecolor);
+
+    /* The dimensions never change, so set things up on the first frame.
+    Y4M needs a constant frame rate, so base it on the first frame's delay.
+    Readers time frames by their position in the stream, so the actual delays
+    are only given in the frame info and the -T timestamps. */
+    if (!yuv) {
+        /* Plus a scratch row for the second luma row of odd heights */
+        yuv = *buf = malloc(luma_size + 2 * chroma_size + width);
+        if (!yuv) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        size = fprintf(fp, "YUV4MPEG2 W%d H%d F100:%d Ip A1:1 C420jpeg\n",
+                       width, height, img->DelayTime ? img->DelayTime : 10);
+        if (size < 0)
+            return -1;
+    }
+
+    uint8_t *u = yuv + luma_size, *v = u + chroma_size;
+    uint8_t *scratch = v + chroma_size;
+    for (int y = 0; y < height; y += 2) {
+        const uint8_t *row0 = img->RasterData + y * stride;
+        const uint8_t *row1 = y + 1 < height ? row0 + stride : row0;
+        uint8_t *y0 = yuv + (size_t)y * width;
+        uint8_t *y1 = y + 1 < height ? y0 + width : scratch;
+        rgba_to_yuv420(row0, row1, width, y0, y1,
+                       u + (size_t)(y / 2) * chroma_width,
+                       v + (size_t)(y / 2) * chroma_width);
+    }
+
+    int header = fprintf(fp, "FRAME\n");
+    if (header < 0)
+        return -1;
+    if (fwrite(yuv, 1, luma_size + 2 * chroma_size, fp)
+        != luma_size + 2 * chroma_size)
+        return -1;
+    return size + header + luma_size + 2 * chroma_size;
+}
+
+static void frame_filename(char *buf, size_t len, const char *output_base,
+                           int frame)
+{
+    snprintf(buf, len, jpeg ? "%s%06d.jpg" : "%s%06d.png", output_base, frame);
+}
+
+/* Print the info line for a frame that has been written, and check it against
+the size limits. Returns 0, or the exit code to stop with. */
+static int finish_frame(FILE *info_fp, int frame, int delay, long frame_size,
+                        long *output_size)
+{
+    fprintf(info_fp, "%d delay=%d\n", frame, delay);
+    if (max_frame_size > 0 && frame_size > max_frame_size) {
+        fprintf(stderr, "Max frame size exceeded (%ld > %ld)\n", frame_size,
+                max_frame_size);
+        return ERR_MAX_FRAME_SIZE;
+    }
+    *output_size += frame_size;
+    if (max_size > 0 && *output_size > max_size) {
+        fprintf(stderr, "Max size exceeded (%ld > %ld)\n", *output_size,
+                max_size);
+        return ERR_MAX_SIZE;
+    }
+    return 0;
+}
+
+/* Whole input file, read by giflib through read_input */
+typedef struct {
+    const GifByteType *data;
+    size_t size;
+    size_t pos;
+} input_buffer;
+
+static int read_input(GifFileType *gif, GifByteType *buf, int len)
+{
+    input_buffer *in = gif->UserData;
+    size_t n = in->size - in->pos;
+    if (n > (size_t)len)
+        n = len;
+    memcpy(buf, in->data + in->pos, n);
+    in->pos += n;
+    return n;
+}
+
+static GifByteType *read_file(const char *filename, size_t *size)
+{
+    FILE *fp = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+    if (!fp)
+        return NULL;
+
+    GifByteType *data = NULL;
+    size_t alloc = 0;
+    *size = 0;
+    for (;;) {
+        if (*size == alloc) {
+            alloc = alloc ? 2 * alloc : 65536;
+            GifByteType *p = realloc(data, alloc);
+            if (!p)
+                break;
+            data = p;
+        }
+        size_t n = fread(data + *size, 1, alloc - *size, fp);
+        *size += n;
+        if (!n) {
+            if (ferror(fp))
+                break;
+            if (fp != stdin)
+                fclose(fp);
+            return data;
+        }
+    }
+    free(data);
+    if (fp != stdin)
         fclose(fp);
+    return NULL;
+}
+
+/* A run of frames that starts at a keyframe (or the first frame), and so can
+be decoded independently of the frames before it */
+typedef struct {
+    int first_frame;
+    int frames;
+    size_t offset;              /* Input offset of the first frame's records */
+} segment;
+
+typedef struct {
+    bool decoded;
+    int delay;
+    long size;                  /* Output size, or <= 0 if not written */
+} frame_result;
+
+typedef struct {
+    input_buffer input;
+    const char *output_base;
+    const GifSplitOptions *options;
+    segment *segments;
+    int segment_count;
+    int next_segment;
+    frame_result *results;
+    pthread_mutex_t lock;
+} parallel_state;
+
+static void split_segment(parallel_state *ps, segment *seg, encoder *enc,
+                          char *filename, size_t fn_len)
+{
+    input_buffer in = ps->input;
+    in.pos = 0;
+
+    GifFileType *gif = DGifOpen(&in, read_input);
+    if (!gif)
+        return;
+    in.pos = seg->offset;
+
+    GifSplitHandle *handle = GifSplitterOpenWithOptions(gif, ps->options);
+    if (!handle) {
+        DGifCloseFile(gif);
+        return;
+    }
+    GifSplitterSetBuiltinLZW(handle, builtin_lzw);
+
+    encoded_frame last = {NULL, 0};
+    for (int i = 0; i < seg->frames; i++) {
+        GifSplitImage *img = GifSplitterReadFrame(handle, jpeg);
+        if (!img)
+            break;
+
+        int frame = seg->first_frame + i;
+        frame_result *result = &ps->results[frame];
+        result->decoded = true;
+        /* The frame past the limit is only decoded, as it would be when
+        processing the frames in order */
+        if (max_frames && frame >= max_frames)
+            break;
+
+        dbgprintf("Read frame %d (truecolor=%d, cmap=%d)\n", frame,
+                  img->IsTruecolor, img->UsedLocalColormap);
+        frame_filename(filename, fn_len, ps->output_base, frame);
+        result->size = write_frame(enc, img, filename,
+                                   crop_width ? &last : NULL);
+        result->delay = img->DelayTime;
+        /* No later frames would be written in sequential mode either */
+        if (result->size <= 0)
+            break;
+    }
+    free(last.data);
+    GifSplitterClose(handle);
+}
+
+static void *split_thread(void *arg)
+{
+    parallel_state *ps = arg;
+    size_t fn_len = strlen(ps->output_base) + 64;
+    char *filename = malloc(fn_len + 1);
+    encoder *enc = encoder_open();
+    if (!filename || !enc) {
+        free(filename);
+        encoder_close(enc);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&ps->lock);
+        int i = ps->next_segment++;
+        pthread_mutex_unlock(&ps->lock);
+        if (i >= ps->segment_count)
+            break;
+        split_segment(ps, &ps->segments[i], enc, filename, fn_len);
+    }
+    free(filename);
+    encoder_close(enc);
+    /* Requests this thread submitted would be cancelled when it exits */
+    writer_flush(output_writer);
+    return NULL;
+}
+
+/* Scan the input for keyframes and group the frames up to the frame limit
+into segments, of which there are a few per thread so that they can be
+balanced between threads. Returns the number of segments, or -1 if the file
+cannot be opened. */
+static int find_segments(input_buffer *in, const GifSplitOptions *options,
+                         segment **segments_out, int *frames_out,
+                         GifSplitInfo *info)
+{
+    in->pos = 0;
+    GifFileType *gif = DGifOpen(in, read_input);
+    if (!gif) {
+        fprintf(stderr, "Failed to open GIF\n");
+        return -1;
+    }
+    GifSplitHandle *handle = GifSplitterOpenWithOptions(gif, options);
+    if (!handle) {
+        fprintf(stderr, "Failed to create GIF splitter handle\n");
+        DGifCloseFile(gif);
         return -1;
     }
-    png_init_io(png_ptr, fp);
 
-    size_t stride;
-    if (img->IsTruecolor) {
-        png_set_IHDR(png_ptr, info_ptr, img->Width, img->Height,
-                     8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
-                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-        stride = 4 * img->Width;
+    /* Start offset of every frame that can begin a segment, else 0 */
+    size_t *starts = NULL;
+    int frames = 0, alloc = 0;
+    for (;;) {
+        size_t offset = in->pos;
+        bool keyframe;
+        if (!GifSplitterSkipFrame(handle, &keyframe))
+            break;
+        if (frames == alloc) {
+            alloc = alloc ? 2 * alloc : 256;
+            size_t *p = realloc(starts, alloc * sizeof(size_t));
+            if (!p) {
+                fprintf(stderr, "Out of memory\n");
+                GifSplitterClose(handle);
+                free(starts);
+                return -1;
+            }
+            starts = p;
+        }
+        starts[frames] = keyframe || !frames ? offset : 0;
+        frames++;
+    }
+    *info = *GifSplitterGetInfo(handle);
+    GifSplitterClose(handle);
+
+    int limit = frames;
+    if (max_frames && limit > max_frames + 1)
+        limit = max_frames + 1;
+
+    int target = (limit + 4 * jobs - 1) / (4 * jobs);
+    segment *segments = malloc((limit + 1) * sizeof(segment));
+    if (!segments) {
+        fprintf(stderr, "Out of memory\n");
+        free(starts);
+        return -1;
+    }
+    int count = 0;
+    for (int frame = 0; frame < limit; frame++) {
+        if (!frame || (starts[frame]
+                       && frame - segments[count - 1].first_frame >= target)) {
+            segments[count].first_frame = frame;
+            segments[count].frames = 0;
+            segments[count].offset = starts[frame];
+            count++;
+        }
+        segments[count - 1].frames++;
+    }
+    free(starts);
+
+    dbgprintf("Split %d frames into %d segments\n", limit, count);
+    *segments_out = segments;
+    *frames_out = frames;
+    return count;
+}
+
+/* Split the GIF with several threads, each working on a run of frames that
+starts at a keyframe. The info output and size limits are then applied in
+frame order, as if the frames had been processed one by one, and files for any
+frames past where that stops are removed again. */
+static int split_parallel(const char *in_filename, const char *output_base,
+                          const GifSplitOptions *options, FILE *info_fp)
+{
+    parallel_state ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.output_base = output_base;
+    ps.options = options;
+
+    size_t fn_len = strlen(output_base) + 64;
+    char *output_filename = NULL;
+    pthread_t *threads = NULL;
+    GifSplitInfo info;
+    int frames;
+    int ret = ERR_UNSPECIFIED;
+
+    dbgprintf("Opening %s...\n", in_filename);
+    GifByteType *data = read_file(in_filename, &ps.input.size);
+    if (!data) {
+        fprintf(stderr, "Failed to open %s\n", in_filename);
+        goto out;
+    }
+    ps.input.data = data;
+
+    ps.segment_count = find_segments(&ps.input, options, &ps.segments,
+                                     &frames, &info);
+    if (ps.segment_count < 0)
+        goto out;
+
+    output_filename = malloc(fn_len + 1);
+    ps.results = calloc(frames + 1, sizeof(frame_result));
+    threads = malloc((jobs + 1) * sizeof(pthread_t));
+    if (!output_filename || !ps.results || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    output_writer = writer_open(writer_threads > 0 ? writer_threads : 0);
+    if (!output_writer) {
+        fprintf(stderr, "Failed to create output writer\n");
+        goto out;
+    }
+
+    pthread_mutex_init(&ps.lock, NULL);
+    int started = 0;
+    while (started < jobs && started < ps.segment_count
+           && !pthread_create(&threads[started], NULL, split_thread, &ps))
+        started++;
+    /* Do the work here if no thread could be started */
+    if (!started)
+        split_thread(&ps);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&ps.lock);
+
+    bool writes_ok = writer_close(output_writer);
+
+    ret = 0;
+    int frame;
+    long output_size = 0;
+    for (frame = 0; frame < frames; frame++) {
+        frame_result *result = &ps.results[frame];
+        if (!result->decoded)
+            break;
+        if (max_frames && frame >= max_frames) {
+            fprintf(stderr, "Max frames exceeded\n");
+            ret = ERR_MAX_FRAMES;
+            break;
+        }
+        /* The encoder or the writer has already said why */
+        if (result->size <= 0) {
+            ret = ERR_UNSPECIFIED;
+            break;
+        }
+        ret = finish_frame(info_fp, frame, result->delay, result->size,
+                           &output_size);
+        if (ret) {
+            frame++;
+            break;
+        }
+    }
+
+    /* Remove any frames written past the point where processing stops */
+    for (int i = frame; i < frames; i++) {
+        if (ps.results[i].size > 0) {
+            frame_filename(output_filename, fn_len, output_base, i);
+            unlink(output_filename);
+        }
+    }
+
+    if (!ret && !writes_ok)
+        ret = ERR_UNSPECIFIED;
+    if (!ret && (frame < frames || info.HasErrors)) {
+        fprintf(stderr, "Error while processing input gif\n");
+        ret = ERR_UNSPECIFIED;
+    }
+    if (!ret)
+        fprintf(info_fp, "loops=%d\n", info.LoopCount);
+
+out:
+    free(threads);
+    free(ps.results);
+    free(ps.segments);
+    free(output_filename);
+    free(data);
+    return ret;
+}
+
+/* Largest sprite sheet dimension. Browsers and most image decoders handle
+this size, and it is well within the JPEG limit. */
+#define MAX_SHEET_DIM 16384
+
+/* Sprite sheet output. Frames are packed into a grid of cells, left to right
+and top to bottom, over as many sheets as needed to stay within
+MAX_SHEET_DIM. Only the current band (one row of cells) is held in memory,
+and it is encoded as soon as it is complete. Like frames, each sheet is
+encoded into memory with the encoder and handed to the output writer. */
+typedef struct {
+    int cells;                  /* Number of cells in all sheets */
+    int cell_width, cell_height;
+    int columns;                /* Cells per band */
+    int rows;                   /* Bands per sheet, except maybe the last */
+    int sheets;
+    int sheet_width;
+
+    int sheet;                  /* Sheet being written, or -1 */
+    int sheet_rows;             /* Bands in this sheet */
+    int band;                   /* Current band within the sheet */
+    uint8_t *pixels;            /* RGBA pixels of the current band */
+    encoder *enc;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_buffer buf;             /* Encoded sheet */
+    unsigned char *jpeg_data;   /* Encoded sheet, in JPEG mode */
+    unsigned long jpeg_size;
+
+    const char *output_base;
+    char *filename;
+    size_t fn_len;
+    long output_size;
+} sprite_state;
+
+/* Pick the grid for cells of the given size. Without a fixed number of
+columns, the sheet is made as close to square as possible. */
+static void sprite_layout(sprite_state *ss, int cells, int width, int height)
+{
+    ss->cells = cells;
+    ss->cell_width = (width + sprite_scale - 1) / sprite_scale;
+    ss->cell_height = (height + sprite_scale - 1) / sprite_scale;
+
+    int columns = sprite_columns;
+    if (!columns) {
+        columns = 1;
+        while (columns < cells
+               && (long)columns * ss->cell_width
+                  < (long)((cells + columns - 1) / columns) * ss->cell_height)
+            columns++;
+    }
+    if (columns > cells)
+        columns = cells;
+    if (columns > MAX_SHEET_DIM / ss->cell_width)
+        columns = MAX_SHEET_DIM / ss->cell_width;
+    if (columns < 1)
+        columns = 1;
+
+    int total_rows = (cells + columns - 1) / columns;
+    int rows = MAX_SHEET_DIM / ss->cell_height;
+    if (rows < 1)
+        rows = 1;
+    if (rows > total_rows)
+        rows = total_rows;
+
+    ss->columns = columns;
+    ss->rows = rows;
+    ss->sheets = rows ? (total_rows + rows - 1) / rows : 0;
+    ss->sheet_width = columns * ss->cell_width;
+    dbgprintf("Sprite layout: %d cells of %dx%d, %d per row, %d rows in %d "
+              "sheets\n", cells, ss->cell_width, ss->cell_height, columns,
+              rows, ss->sheets);
+}
+
+static bool sprite_start_sheet(sprite_state *ss)
+{
+    int first_row = ss->sheet * ss->rows;
+    int total_rows = (ss->cells + ss->columns - 1) / ss->columns;
+    ss->sheet_rows = total_rows - first_row;
+    if (ss->sheet_rows > ss->rows)
+        ss->sheet_rows = ss->rows;
+    ss->band = 0;
+
+    frame_filename(ss->filename, ss->fn_len, ss->output_base, ss->sheet);
+
+    int height = ss->sheet_rows * ss->cell_height;
+    if (jpeg) {
+        struct jpeg_compress_struct *cinfo = &ss->enc->cinfo;
+        ss->jpeg_data = NULL;
+        ss->jpeg_size = 0;
+        jpeg_mem_dest(cinfo, &ss->jpeg_data, &ss->jpeg_size);
+        cinfo->image_width = ss->sheet_width;
+        cinfo->image_height = height;
+        jpeg_start_compress(cinfo, TRUE);
+        return true;
+    }
+
+    memset(&ss->buf, 0, sizeof(ss->buf));
+    ss->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                          NULL, NULL, NULL);
+    if (!ss->png_ptr) {
+        fprintf(stderr, "Out of memory\n");
+        goto fail;
+    }
+    ss->info_ptr = png_create_info_struct(ss->png_ptr);
+    if (!ss->info_ptr) {
+        fprintf(stderr, "Out of memory\n");
+        goto fail;
+    }
+    if (setjmp(png_jmpbuf(ss->png_ptr))) {
+        fprintf(stderr, "libpng returned an error\n");
+        goto fail;
+    }
+    png_set_write_fn(ss->png_ptr, &ss->buf, png_buffer_write,
+                     png_buffer_flush);
+    png_set_IHDR(ss->png_ptr, ss->info_ptr, ss->sheet_width, height,
+                 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(ss->png_ptr, ss->info_ptr);
+    return true;
+
+fail:
+    png_destroy_write_struct(&ss->png_ptr, &ss->info_ptr);
+    free(ss->buf.data);
+    ss->sheet = -1;
+    return false;
+}
+
+/* Encode the current band and clear it for the next one */
+static bool sprite_write_band(sprite_state *ss)
+{
+    size_t stride = 4 * (size_t)ss->sheet_width;
+
+    if (jpeg) {
+        /* Allocated along with the band, so that this cannot fail */
+        JSAMPLE *row = ss->enc->row;
+        JSAMPROW row_pointer[1] = { row };
+        uint8_t *p = ss->pixels;
+        for (int y = 0; y < ss->cell_height; y++, p += stride) {
+            /* Blend onto the background color, as downsampled pixels may be
+            partially transparent */
+            for (int x = 0; x < ss->sheet_width; x++) {
+                const uint8_t *q = p + 4 * x;
+                for (int c = 0; c < 3; c++)
+                    row[3 * x + c] = (q[c] * q[3]
+                                      + background[c] * (255 - q[3])
+                                      + 127) / 255;
+            }
+            jpeg_write_scanlines(&ss->enc->cinfo, row_pointer, 1);
+        }
     } else {
-        assert(img->ColorMap);
-        int bpp = img->ColorMap->BitsPerPixel;
-        /* Round to next power of two */
-        while (bpp & (bpp - 1))
-            bpp++;
-        png_set_IHDR(png_ptr, info_ptr, img->Width, img->Height,
-                     bpp, PNG_COLOR_TYPE_PALETTE,
-                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                     PNG_FILTER_TYPE_DEFAULT);
-        /* GifColorType should have the same layout as png_color */
-        png_set_PLTE(png_ptr, info_ptr, (png_color*)img->ColorMap->Colors,
-                     img->ColorMap->ColorCount);
-        if (img->TransparentColorIndex != -1) {
-            png_byte trans_alpha[256];
-            memset(trans_alpha, 255, img->TransparentColorIndex);
-            trans_alpha[img->TransparentColorIndex] = 0;
-            png_set_tRNS(png_ptr, info_ptr, trans_alpha,
-                         img->TransparentColorIndex + 1, NULL);
+        if (setjmp(png_jmpbuf(ss->png_ptr))) {
+            fprintf(stderr, "libpng returned an error\n");
+            return false;
         }
-        stride = img->Width;
+        for (int y = 0; y < ss->cell_height; y++)
+            png_write_row(ss->png_ptr, ss->pixels + y * stride);
     }
+    memset(ss->pixels, 0, stride * ss->cell_height);
+    ss->band++;
+    return true;
+}
 
-    png_bytep p = img->RasterData;
-    for (int i = 0; i < img->Height; i++) {
-        row_pointers[i] = p;
-        p += stride;
+static bool sprite_end_png(sprite_state *ss)
+{
+    if (setjmp(png_jmpbuf(ss->png_ptr))) {
+        fprintf(stderr, "libpng returned an error\n");
+        return false;
     }
-    png_set_rows(png_ptr, info_ptr, row_pointers);
-    png_write_png(png_ptr, info_ptr,
-                  img->IsTruecolor ? 0 : PNG_TRANSFORM_PACKING, NULL);
+    png_write_end(ss->png_ptr, ss->info_ptr);
+    return true;
+}
 
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fclose(fp);
-    free(row_pointers);
-    return size;
+/* Finish the current sheet, hand it to the writer and check it against the
+size limits. Returns 0, or the exit code to stop with. */
+static int sprite_finish_sheet(sprite_state *ss)
+{
+    bool ok = true;
+
+    /* Pad out a sheet that was cut short by a broken frame */
+    while (ok && ss->band < ss->sheet_rows)
+        ok = sprite_write_band(ss);
+
+    void *data;
+    size_t size;
+    if (jpeg) {
+        jpeg_finish_compress(&ss->enc->cinfo);
+        data = ss->jpeg_data;
+        size = ss->jpeg_size;
+    } else {
+        ok = ok && sprite_end_png(ss);
+        png_destroy_write_struct(&ss->png_ptr, &ss->info_ptr);
+        data = ss->buf.data;
+        size = ss->buf.size;
+    }
+    ss->sheet = -1;
+
+    /* Encoding errors have been reported already, and write errors are
+    reported by the writer */
+    if (!ok) {
+        free(data);
+        return ERR_UNSPECIFIED;
+    }
+    if (!writer_submit(output_writer, ss->filename, data, size))
+        return ERR_UNSPECIFIED;
+
+    dbgprintf("Wrote sheet %s (%zu bytes)\n", ss->filename, size);
+    if (max_frame_size > 0 && (long)size > max_frame_size) {
+        fprintf(stderr, "Max frame size exceeded (%ld > %ld)\n", (long)size,
+                max_frame_size);
+        return ERR_MAX_FRAME_SIZE;
+    }
+    ss->output_size += size;
+    if (max_size > 0 && ss->output_size > max_size) {
+        fprintf(stderr, "Max size exceeded (%ld > %ld)\n", ss->output_size,
+                max_size);
+        return ERR_MAX_SIZE;
+    }
+    return 0;
+}
+
+/* Downsample a truecolor frame into its cell of the band, averaging each
+block of sprite_scale x sprite_scale pixels. Colors are weighted by alpha, so
+that transparent pixels do not bleed into the opaque ones. */
+static void sprite_put_frame(sprite_state *ss, GifSplitImage *img, int column)
+{
+    size_t src_stride = 4 * (size_t)img->Width;
+    size_t dst_stride = 4 * (size_t)ss->sheet_width;
+    uint8_t *dst = ss->pixels + 4 * (size_t)column * ss->cell_width;
+    int scale = sprite_scale;
+
+    if (scale == 1) {
+        for (int y = 0; y < img->Height; y++)
+            memcpy(dst + y * dst_stride, img->RasterData + y * src_stride,
+                   src_stride);
+        return;
+    }
+
+    for (int y = 0; y < ss->cell_height; y++) {
+        int y0 = y * scale, y1 = y0 + scale;
+        if (y1 > img->Height)
+            y1 = img->Height;
+        uint8_t *out = dst + y * dst_stride;
+        for (int x = 0; x < ss->cell_width; x++) {
+            int x0 = x * scale, x1 = x0 + scale;
+            if (x1 > img->Width)
+                x1 = img->Width;
+            unsigned sum[4] = {0, 0, 0, 0};
+            for (int sy = y0; sy < y1; sy++) {
+                const uint8_t *p = img->RasterData + sy * src_stride + 4 * x0;
+                for (int sx = x0; sx < x1; sx++, p += 4) {
+                    sum[0] += p[0] * p[3];
+                    sum[1] += p[1] * p[3];
+                    sum[2] += p[2] * p[3];
+                    sum[3] += p[3];
+                }
+            }
+            unsigned n = (y1 - y0) * (x1 - x0);
+            for (int c = 0; c < 3; c++)
+                out[4 * x + c] = sum[3] ? (sum[c] + sum[3] / 2) / sum[3] : 0;
+            out[4 * x + 3] = (sum[3] + n / 2) / n;
+        }
+    }
+}
+
+static void print_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Count the frames, and with -u, find the ones that are the same as the frame
+before them. Returns the number of frames, or -1 if the file cannot be
+opened. */
+static int scan_sprite_frames(input_buffer *in, const GifSplitOptions *options,
+                              bool **dups_out, GifSplitInfo *info)
+{
+    in->pos = 0;
+    GifFileType *gif = DGifOpen(in, read_input);
+    if (!gif) {
+        fprintf(stderr, "Failed to open GIF\n");
+        return -1;
+    }
+    GifSplitHandle *handle = GifSplitterOpenWithOptions(gif, options);
+    if (!handle) {
+        fprintf(stderr, "Failed to create GIF splitter handle\n");
+        DGifCloseFile(gif);
+        return -1;
+    }
+    GifSplitterSetBuiltinLZW(handle, builtin_lzw);
+
+    bool *dups = NULL;
+    uint8_t *prev = NULL;
+    int frames = 0, alloc = 0;
+    for (;;) {
+        bool dup = false;
+        if (sprite_dedup) {
+            GifSplitImage *img = GifSplitterReadFrame(handle, true);
+            if (!img)
+                break;
+            size_t size = (size_t)img->Width * img->Height * 4;
+            if (!prev && !(prev = malloc(size)))
+                goto oom;
+            dup = frames && (img->Unchanged
+                             || !memcmp(prev, img->RasterData, size));
+            if (!dup)
+                memcpy(prev, img->RasterData, size);
+        } else {
+            bool keyframe;
+            if (!GifSplitterSkipFrame(handle, &keyframe))
+                break;
+        }
+        if (frames == alloc) {
+            alloc = alloc ? 2 * alloc : 256;
+            bool *p = realloc(dups, alloc * sizeof(bool));
+            if (!p)
+                goto oom;
+            dups = p;
+        }
+        dups[frames++] = dup;
+    }
+    *info = *GifSplitterGetInfo(handle);
+    GifSplitterClose(handle);
+    free(prev);
+    *dups_out = dups;
+    return frames;
+
+oom:
+    fprintf(stderr, "Out of memory\n");
+    GifSplitterClose(handle);
+    free(prev);
+    free(dups);
+    return -1;
+}
+
+/* Write all frames into sprite sheets, with a JSON manifest of where every
+frame is in place of the frame info. The input is read twice: once to count
+the frames (and find duplicates), so that the size of every sheet is known
+before it is started, and once to write them. */
+static int split_sprites(const char *in_filename, const char *output_base,
+                         const GifSplitOptions *options, FILE *info_fp)
+{
+    input_buffer in = {NULL, 0, 0};
+    bool *dups = NULL;
+    GifSplitInfo info;
+    GifSplitHandle *handle = NULL;
+    sprite_state ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.sheet = -1;
+    ss.fn_len = strlen(output_base) + 64;
+    ss.output_base = output_base;
+    int ret = ERR_UNSPECIFIED;
+
+    dbgprintf("Opening %s...\n", in_filename);
+    GifByteType *data = read_file(in_filename, &in.size);
+    if (!data) {
+        fprintf(stderr, "Failed to open %s\n", in_filename);
+        goto out;
+    }
+    in.data = data;
+
+    int frames = scan_sprite_frames(&in, options, &dups, &info);
+    if (frames < 0)
+        goto out;
+    /* Nothing is written unless all of it can be */
+    if (max_frames && frames > max_frames) {
+        fprintf(stderr, "Max frames exceeded\n");
+        ret = ERR_MAX_FRAMES;
+        goto out;
+    }
+    int cells = 0;
+    for (int i = 0; i < frames; i++)
+        cells += !dups[i];
+
+    ss.filename = malloc(ss.fn_len + 1);
+    ss.enc = encoder_open();
+    if (!ss.filename || !ss.enc) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    in.pos = 0;
+    GifFileType *gif = DGifOpen(&in, read_input);
+    if (!gif) {
+        fprintf(stderr, "Failed to open GIF\n");
+        goto out;
+    }
+    handle = GifSplitterOpenWithOptions(gif, options);
+    if (!handle) {
+        fprintf(stderr, "Failed to create GIF splitter handle\n");
+        DGifCloseFile(gif);
+        goto out;
+    }
+    GifSplitterSetBuiltinLZW(handle, builtin_lzw);
+
+    output_writer = writer_open(0);
+    if (!output_writer) {
+        fprintf(stderr, "Failed to create output writer\n");
+        goto out;
+    }
+
+    ret = 0;
+    int frame, cell = -1;
+    fprintf(info_fp, "{\n");
+    for (frame = 0; frame < frames; frame++) {
+        GifSplitImage *img = GifSplitterReadFrame(handle, true);
+        if (!img)
+            break;
+        dbgprintf("Read frame %d (dup=%d)\n", frame, dups[frame]);
+
+        if (!frame) {
+            sprite_layout(&ss, cells, img->Width, img->Height);
+            /* A sheet is at least one cell, and may not be any larger */
+            if (jpeg && (ss.cell_width > JPEG_MAX_DIMENSION
+                         || ss.cell_height > JPEG_MAX_DIMENSION)) {
+                fprintf(stderr, "Frames too large for a JPEG sprite sheet "
+                        "(%dx%d > %ld)\n", ss.cell_width, ss.cell_height,
+                        (long)JPEG_MAX_DIMENSION);
+                ret = ERR_UNSPECIFIED;
+                break;
+            }
+            size_t band_size = 4 * (size_t)ss.sheet_width * ss.cell_height;
+            ss.pixels = calloc(1, band_size);
+            if (!ss.pixels || (jpeg && !encoder_jpeg_row(ss.enc,
+                                           3 * (size_t)ss.sheet_width))) {
+                fprintf(stderr, "Out of memory\n");
+                ret = ERR_UNSPECIFIED;
+                break;
+            }
+            fprintf(info_fp, "  \"frame_width\": %d,\n", ss.cell_width);
+            fprintf(info_fp, "  \"frame_height\": %d,\n", ss.cell_height);
+            fprintf(info_fp, "  \"sheets\": [");
+            for (int i = 0; i < ss.sheets; i++) {
+                frame_filename(ss.filename, ss.fn_len, output_base, i);
+                if (i)
+                    fputs(", ", info_fp);
+                print_json_string(info_fp, ss.filename);
+            }
+            fprintf(info_fp, "],\n  \"frames\": [\n");
+        }
+
+        if (!dups[frame]) {
+            cell++;
+            int column = cell % ss.columns;
+            if (ss.sheet < 0) {
+                ss.sheet = cell / (ss.columns * ss.rows);
+                if (!sprite_start_sheet(&ss)) {
+                    ret = ERR_UNSPECIFIED;
+                    break;
+                }
+            }
+            sprite_put_frame(&ss, img, column);
+            /* Encode the band once it is full, and finish the sheet with its
+            last band */
+            if (column == ss.columns - 1 || cell == cells - 1) {
+                if (!sprite_write_band(&ss)) {
+                    ret = ERR_UNSPECIFIED;
+                    break;
+                }
+                if (ss.band == ss.sheet_rows) {
+                    ret = sprite_finish_sheet(&ss);
+                    if (ret)
+                        break;
+                }
+            }
+        }
+
+        int index = cell % (ss.columns * ss.rows);
+        fprintf(info_fp, "%s    {\"sheet\": %d, \"x\": %d, \"y\": %d, "
+                "\"w\": %d, \"h\": %d, \"delay\": %d}", frame ? ",\n" : "",
+                cell / (ss.columns * ss.rows),
+                index % ss.columns * ss.cell_width,
+                index / ss.columns * ss.cell_height,
+                ss.cell_width, ss.cell_height, img->DelayTime);
+    }
+    if (frame < frames && ss.sheet >= 0) {
+        int finish_ret = sprite_finish_sheet(&ss);
+        if (!ret)
+            ret = finish_ret;
+    }
+    if (!writer_close(output_writer) && !ret)
+        ret = ERR_UNSPECIFIED;
+
+    if (!ret && (frame < frames || GifSplitterGetInfo(handle)->HasErrors)) {
+        fprintf(stderr, "Error while processing input gif\n");
+        ret = ERR_UNSPECIFIED;
+    }
+    if (!ret) {
+        if (!frames)
+            fprintf(info_fp, "  \"sheets\": [],\n  \"frames\": [");
+        fprintf(info_fp, "\n  ],\n  \"loops\": %d\n}\n", info.LoopCount);
+    }
+
+out:
+    if (handle)
+        GifSplitterClose(handle);
+    encoder_close(ss.enc);
+    free(ss.pixels);
+    free(ss.filename);
+    free(dups);
+    free(data);
+    return ret;
 }
 
 int main(int argc, char **argv)
 {
     int opt;
-    while ((opt = getopt(argc, argv, "hvVq:s:om:M:F:")) != -1) {
+    while ((opt = getopt(argc, argv, "hvVq:s:or:b:d:T:m:M:F:lP:t:w:j:p:c:g:z:u")) != -1) {
         switch (opt) {
         case 'v':
             verbose = 1;
@@ -245,6 +1579,29 @@ int main(int argc, char **argv)
         case 'o':
             optimize = true;
             break;
+        case 'r':
+            if (!strcmp(optarg, "rgba")) {
+                raw = RAW_RGBA;
+            } else if (!strcmp(optarg, "y4m")) {
+                raw = RAW_Y4M;
+            } else {
+                usage(argv[0]);
+                return ERR_UNSPECIFIED;
+            }
+            break;
+        case 'b': {
+            unsigned long rgb = strtoul(optarg, NULL, 16);
+            background[0] = rgb >> 16;
+            background[1] = rgb >> 8;
+            background[2] = rgb;
+            break;
+        }
+        case 'd':
+            info_filename = optarg;
+            break;
+        case 'T':
+            timestamps_filename = optarg;
+            break;
         case 'm':
             max_frames = atoi(optarg);
             break;
@@ -254,6 +1611,53 @@ int main(int argc, char **argv)
         case 'F':
             max_frame_size = atoi(optarg);
             break;
+        case 'l':
+            builtin_lzw = true;
+            break;
+        case 'P':
+            max_pixels = atol(optarg);
+            if (max_pixels < 0) {
+                usage(argv[0]);
+                return ERR_UNSPECIFIED;
+            }
+            break;
+        case 't':
+            spill_dir = optarg;
+            break;
+        case 'w':
+            writer_threads = atoi(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'p':
+            png_threads = atoi(optarg);
+            break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d,%d,%d", &crop_left, &crop_top,
+                       &crop_width, &crop_height) != 4
+                || crop_width <= 0 || crop_height <= 0) {
+                usage(argv[0]);
+                return ERR_UNSPECIFIED;
+            }
+            break;
+        case 'g':
+            sprite_columns = atoi(optarg);
+            if (sprite_columns < 0) {
+                usage(argv[0]);
+                return ERR_UNSPECIFIED;
+            }
+            break;
+        case 'z':
+            sprite_scale = atoi(optarg);
+            if (sprite_scale < 1) {
+                usage(argv[0]);
+                return ERR_UNSPECIFIED;
+            }
+            break;
+        case 'u':
+            sprite_dedup = true;
+            break;
         default: /* 'h' */
             usage(argv[0]);
             return ERR_UNSPECIFIED;
@@ -265,6 +1669,21 @@ int main(int argc, char **argv)
         return ERR_UNSPECIFIED;
     }
 
+    if (sampling < 0 || sampling > 2) {
+        sampling = quality < 90 ? 2 : 0;
+    }
+
+    /* Sheets are built in a single pass over the frames, in order, and take
+    the place of the frame files */
+    if (sprite_columns >= 0 && (jobs > 0 || raw || writer_threads > 0)) {
+        fprintf(stderr, "-g cannot be combined with -j, -r or -w\n");
+        return ERR_UNSPECIFIED;
+    }
+    if (timestamps_filename && !raw) {
+        fprintf(stderr, "-T requires -r\n");
+        return ERR_UNSPECIFIED;
+    }
+
     const char *in_filename = argv[optind];
     const char *output_base = argv[optind + 1];
     size_t fn_len = strlen(output_base) + 64;
@@ -275,6 +1694,62 @@ int main(int argc, char **argv)
     }
     memset(output_filename, 0, fn_len + 1);
 
+    FILE *raw_fp = NULL;
+    FILE *info_fp = stdout;
+    if (raw) {
+        if (!strcmp(output_base, "-")) {
+            raw_fp = stdout;
+            info_fp = stderr;
+        } else {
+            raw_fp = fopen(output_base, "wb");
+        }
+        if (!raw_fp) {
+            fprintf(stderr, "Failed to open %s\n", output_base);
+            return ERR_UNSPECIFIED;
+        }
+    }
+    if (info_filename) {
+        info_fp = fopen(info_filename, "w");
+        if (!info_fp) {
+            fprintf(stderr, "Failed to open %s\n", info_filename);
+            return ERR_UNSPECIFIED;
+        }
+    }
+    FILE *timestamps_fp = NULL;
+    if (timestamps_filename) {
+        timestamps_fp = fopen(timestamps_filename, "w");
+        if (!timestamps_fp) {
+            fprintf(stderr, "Failed to open %s\n", timestamps_filename);
+            return ERR_UNSPECIFIED;
+        }
+        fprintf(timestamps_fp, "# timestamp format v2\n");
+    }
+
+    GifSplitOptions options = {
+        .MaxPixels = max_pixels,
+        .SpillDir = spill_dir,
+        .CropLeft = crop_left,
+        .CropTop = crop_top,
+        .CropWidth = crop_width,
+        .CropHeight = crop_height,
+    };
+
+    if (sprite_columns >= 0) {
+        int ret = split_sprites(in_filename, output_base, &options, info_fp);
+        if (info_filename)
+            fclose(info_fp);
+        free(output_filename);
+        return ret;
+    }
+
+    if (jobs > 0 && !raw) {
+        int ret = split_parallel(in_filename, output_base, &options, info_fp);
+        if (info_filename)
+            fclose(info_fp);
+        free(output_filename);
+        return ret;
+    }
+
     dbgprintf("Opening %s...\n", in_filename);
 
     GifFileType *gif;
@@ -289,54 +1764,89 @@ int main(int argc, char **argv)
         return ERR_UNSPECIFIED;
     }
 
-    GifSplitHandle *handle = GifSplitterOpen(gif);
+    GifSplitHandle *handle = GifSplitterOpenWithOptions(gif, &options);
     if (!handle) {
-        fprintf(stderr, "Failed to greate GIF splitter handle\n");
+        fprintf(stderr, "Failed to create GIF splitter handle\n");
+        return ERR_UNSPECIFIED;
+    }
+    GifSplitterSetBuiltinLZW(handle, builtin_lzw);
+
+    encoder *enc = NULL;
+    if (!raw && !(enc = encoder_open())) {
+        fprintf(stderr, "Out of memory\n");
+        return ERR_UNSPECIFIED;
+    }
+
+    output_writer = writer_open(writer_threads > 0 ? writer_threads : 0);
+    if (!output_writer) {
+        fprintf(stderr, "Failed to create output writer\n");
         return ERR_UNSPECIFIED;
     }
 
     GifSplitImage *img;
     int frame = 0;
     long output_size = 0;
+    encoded_frame last = {NULL, 0};
+    uint8_t *yuv = NULL;
+    long timestamp = 0;
+
+    int ret = 0;
 
-    while ((img = GifSplitterReadFrame(handle, jpeg))) {
+    while ((img = GifSplitterReadFrame(handle, jpeg || raw))) {
         long frame_size = 0;
         if (max_frames && frame >= max_frames) {
             fprintf(stderr, "Max frames exceeded\n");
-            return ERR_MAX_FRAMES;
+            ret = ERR_MAX_FRAMES;
+            break;
         }
         dbgprintf("Read frame %d (truecolor=%d, cmap=%d)\n", frame,
                   img->IsTruecolor, img->UsedLocalColormap);
-        snprintf(output_filename, fn_len, "%s%06d.%s", output_base, frame,
-                 jpeg ? "jpg" : "png");
-        if (jpeg) {
-            frame_size = write_jpeg(img, output_filename);
+        if (raw) {
+            /* Raw RGBA has no header, so give the size in the frame info */
+            if (raw == RAW_RGBA && !frame)
+                fprintf(info_fp, "width=%d height=%d\n", img->Width,
+                        img->Height);
+            if (raw == RAW_Y4M)
+                frame_size = write_y4m(img, raw_fp, &yuv);
+            else
+                frame_size = write_rgba(img, raw_fp);
             if (frame_size <= 0) {
-                fprintf(stderr, "Failed to write to %s\n", output_filename);
-                return ERR_UNSPECIFIED;
+                fprintf(stderr, "Failed to write to %s\n", output_base);
+                ret = ERR_UNSPECIFIED;
+                break;
+            }
+            /* Start times in milliseconds. A zero delay counts as 10, as it
+            does for the y4m frame rate, so that they keep increasing. */
+            if (timestamps_fp) {
+                fprintf(timestamps_fp, "%ld\n", timestamp);
+                timestamp += 10 * (img->DelayTime ? img->DelayTime : 10);
             }
         } else {
-            frame_size = write_png(img, output_filename);
+            frame_filename(output_filename, fn_len, output_base, frame);
+            frame_size = write_frame(enc, img, output_filename,
+                                     crop_width ? &last : NULL);
+            /* The encoder or the writer has already said why */
             if (frame_size <= 0) {
-                fprintf(stderr, "Failed to write to %s\n", output_filename);
-                return ERR_UNSPECIFIED;
+                ret = ERR_UNSPECIFIED;
+                break;
             }
         }
-        printf("%d delay=%d\n", frame, img->DelayTime);
-        if (max_frame_size > 0 && frame_size > max_frame_size) {
-            fprintf(stderr, "Max frame size exceeded (%ld > %ld)\n", frame_size,
-                    max_frame_size);
-            return ERR_MAX_FRAME_SIZE;
-        }
-        output_size += frame_size;
-        if (max_size > 0 && output_size > max_size) {
-            fprintf(stderr, "Max size exceeded (%ld > %ld)\n", output_size,
-                    max_size);
-            return ERR_MAX_SIZE;
-        }
+        ret = finish_frame(info_fp, frame, img->DelayTime, frame_size,
+                           &output_size);
+        if (ret)
+            break;
         frame++;
     }
 
+    free(yuv);
+
+    /* Wait for every write queued so far, on every way out, and make sure
+    every frame is on disk before reporting success */
+    if (!writer_close(output_writer) && !ret)
+        ret = ERR_UNSPECIFIED;
+    if (ret)
+        return ret;
+
     GifSplitInfo *info;
     info = GifSplitterGetInfo(handle);
     if (info->HasErrors) {
@@ -344,9 +1854,22 @@ int main(int argc, char **argv)
         return ERR_UNSPECIFIED;
     }
     if (info)
-        printf("loops=%d\n", info->LoopCount);
+        fprintf(info_fp, "loops=%d\n", info->LoopCount);
+
+    if (raw_fp && fclose(raw_fp)) {
+        fprintf(stderr, "Failed to write to %s\n", output_base);
+        return ERR_UNSPECIFIED;
+    }
+    if (timestamps_fp && fclose(timestamps_fp)) {
+        fprintf(stderr, "Failed to write to %s\n", timestamps_filename);
+        return ERR_UNSPECIFIED;
+    }
+    if (info_filename)
+        fclose(info_fp);
 
     GifSplitterClose(handle);
+    encoder_close(enc);
+    free(last.data);
     free(output_filename);
     return 0;
 }
@@ -1,26 +1,58 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "libgifsplit.h"
+#include "giflzw.h"
 #include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* Rasters at least this large are spilled to a temporary file, if enabled */
+#define SPILL_MIN_SIZE (1 << 20)
+
+/* GIF dimensions are 16-bit, so this is enough for any row */
+#define MAX_ROW_SIZE 65536
+
+struct ComposeState_t;
 
-/* Sanity/safety limit: no gifs larger than 10 megapixels per frame */
-#define MAX_FRAME_SIZE 10000000
+/* Applies one row of frame pixels p to the canvas row q */
+typedef void (*ComposeFunc)(const struct ComposeState_t *state,
+                            GifPixelType *q, const GifPixelType *p);
+
+/* How the rows of the current frame are applied to the canvas */
+typedef struct ComposeState_t {
+    GifSplitImage *Canvas;
+    GifWord TransparentColorIndex;
+    int Left, Top;
+    int Width, Height;          /* Clipped to the canvas */
+    int SrcLeft, SrcTop;        /* Offset of the clipped area in the frame */
+    ComposeFunc Compose;        /* Kernel for this frame, see ComposeRow() */
+    uint8_t Palette[256][4];    /* RGBA for every index, in truecolor mode */
+} ComposeState;
 
 struct GifSplitHandle_t {
     GifFileType *File;
     GifPixelType *ReadBuf;
-    GifImageDesc PrevImage;
+    GifImageDesc PrevImage;     /* Area of the previous frame on the canvas */
     GifWord PrevDisposal;
     bool PrevFull;
     GifSplitImage *Canvas;
-    GifSplitImage *PrevCanvas;
+    GifSplitImage *PrevCanvas;  /* Area under the previous frame, if it is
+                                   to be disposed to previous */
+    int PrevCanvasLeft, PrevCanvasTop;
+    int CropLeft, CropTop;      /* Position of the canvas on the screen */
+    bool Cropped;               /* Canvas is smaller than the screen */
     GifSplitInfo Info;
+    char *SpillDir;
+    bool BuiltinLZW;
+    GifLZWDecoder LZW;
 };
 
-static int InterlacedOffset[] = { 0, 4, 2, 1 };
-static int InterlacedJumps[] = { 8, 8, 4, 2 };
-
 static size_t GetImageSize(GifSplitImage *image) {
     size_t raster_bytes = (size_t)image->Width * (size_t)image->Height;
     if (image->IsTruecolor)
@@ -28,7 +60,56 @@ static size_t GetImageSize(GifSplitImage *image) {
     return raster_bytes;
 }
 
-static GifSplitImage *AllocImage(GifWord width, GifWord height, bool truecolor)
+static GifPixelType *GetPixel(GifSplitImage *image, int x, int y)
+{
+    size_t offset = (size_t)y * image->Width + x;
+    if (image->IsTruecolor)
+        offset *= 4;
+    return image->RasterData + offset;
+}
+
+static bool IsSpilled(GifSplitHandle *handle, size_t size)
+{
+    return handle->SpillDir && size >= SPILL_MIN_SIZE;
+}
+
+/* Allocate raster memory, backed by an unlinked temporary file if it is large
+ * and spilling is enabled, so the kernel can page it out under pressure. The
+ * file's blocks are reserved up front: a sparse file would only run out of
+ * space once its pages are touched, which kills the process with SIGBUS. */
+static GifPixelType *AllocRaster(GifSplitHandle *handle, size_t size)
+{
+    if (!IsSpilled(handle, size))
+        return malloc(size);
+
+    size_t len = strlen(handle->SpillDir) + 32;
+    char *path = malloc(len);
+    if (!path)
+        return NULL;
+    snprintf(path, len, "%s/gifsplit-XXXXXX", handle->SpillDir);
+
+    void *data = MAP_FAILED;
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        if (!posix_fallocate(fd, 0, size))
+            data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    free(path);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+static void FreeRaster(GifSplitHandle *handle, GifPixelType *data, size_t size)
+{
+    if (IsSpilled(handle, size))
+        munmap(data, size);
+    else
+        free(data);
+}
+
+static GifSplitImage *AllocImage(GifSplitHandle *handle, GifWord width,
+                                 GifWord height, bool truecolor)
 {
     GifSplitImage *img = malloc(sizeof(GifSplitImage));
     if (!img)
@@ -38,7 +119,8 @@ static GifSplitImage *AllocImage(GifWord width, GifWord height, bool truecolor)
     img->IsTruecolor = truecolor;
     img->Width = width;
     img->Height = height;
-    img->RasterData = malloc(GetImageSize(img));
+    img->TransparentColorIndex = -1;
+    img->RasterData = AllocRaster(handle, GetImageSize(img));
     if (!img->RasterData) {
         free(img);
         return NULL;
@@ -46,12 +128,12 @@ static GifSplitImage *AllocImage(GifWord width, GifWord height, bool truecolor)
     return img;
 }
 
-static void FreeImage(GifSplitImage *image)
+static void FreeImage(GifSplitHandle *handle, GifSplitImage *image)
 {
     if (!image)
         return;
     if (image->RasterData) {
-        free(image->RasterData);
+        FreeRaster(handle, image->RasterData, GetImageSize(image));
         image->RasterData = NULL;
     }
     if (image->ColorMap) {
@@ -71,42 +153,59 @@ static bool ReplaceColorMap(GifSplitImage *dst, ColorMapObject *map)
     return true;
 }
 
-static GifSplitImage *CloneImage(GifSplitImage *src)
+static bool SameColorMap(ColorMapObject *a, ColorMapObject *b)
 {
-    GifSplitImage *dst;
+    return a->ColorCount == b->ColorCount
+           && !memcmp(a->Colors, b->Colors,
+                      sizeof(GifColorType) * a->ColorCount);
+}
 
-    dst = AllocImage(src->Width, src->Height, src->IsTruecolor);
-    if (!dst)
-        return NULL;
+/* Change an image's pixel format, discarding its contents */
+static bool ResetImage(GifSplitHandle *handle, GifSplitImage **image,
+                       bool truecolor)
+{
+    if ((*image)->IsTruecolor == truecolor)
+        return true;
 
-    if (!src->ColorMap) {
-        dst->ColorMap = NULL;
-    } else {
-        if (!ReplaceColorMap(dst, src->ColorMap))
-            return NULL;
-    }
+    GifSplitImage *new_image = AllocImage(handle, (*image)->Width,
+                                          (*image)->Height, truecolor);
+    if (!new_image)
+        return false;
+    FreeImage(handle, *image);
+    *image = new_image;
+    return true;
+}
+
+/* Copy a rectangle between two images of the same pixel format */
+static void CopyRect(GifSplitImage *dst, int dst_x, int dst_y,
+                     GifSplitImage *src, int src_x, int src_y,
+                     int width, int height)
+{
+    int pixel_size = dst->IsTruecolor ? 4 : 1;
 
-    memcpy(dst->RasterData, src->RasterData, GetImageSize(dst));
-    dst->TransparentColorIndex = src->TransparentColorIndex;
-    dst->DelayTime = src->DelayTime;
-    return dst;
+    assert(dst->IsTruecolor == src->IsTruecolor);
+    for (int y = 0; y < height; y++) {
+        memcpy(GetPixel(dst, dst_x, dst_y + y), GetPixel(src, src_x, src_y + y),
+               (size_t)width * pixel_size);
+    }
 }
 
-static bool ToTruecolor(GifSplitImage *image)
+static bool ToTruecolor(GifSplitHandle *handle, GifSplitImage *image)
 {
     if (image->IsTruecolor)
         return true;
 
+    ColorMapObject *map = image->ColorMap;
+    if (!map)
+        return false;
+
+    size_t pixels = (size_t)image->Width * (size_t)image->Height;
     GifPixelType *new_data;
-    new_data = malloc(image->Width * image->Height * 4);
+    new_data = AllocRaster(handle, pixels * 4);
     if (!new_data)
         return false;
-    size_t pixels = (size_t)image->Width * (size_t)image->Height;
 
     GifPixelType *src, *dst;
-    ColorMapObject *map = image->ColorMap;
-    if (!map)
-        return false;
     src = image->RasterData;
     dst = new_data;
     while (pixels--) {
@@ -119,20 +218,108 @@ static bool ToTruecolor(GifSplitImage *image)
         *dst++ = (*src == image->TransparentColorIndex) ? 0 : 255;
         src++;
     }
+    FreeRaster(handle, image->RasterData, GetImageSize(image));
     image->IsTruecolor = true;
-    free(image->RasterData);
     image->RasterData = new_data;
     image->TransparentColorIndex = -1;
     return true;
 }
 
+/* Save the area of the canvas that the current frame is about to draw on, so
+ * that it can be restored when the frame is disposed to previous. */
+static bool SavePrevious(GifSplitHandle *handle, int left, int top,
+                         int width, int height)
+{
+    GifSplitImage *canvas = handle->Canvas;
+
+    FreeImage(handle, handle->PrevCanvas);
+    handle->PrevCanvas = NULL;
+    if (width <= 0 || height <= 0)
+        return true;
+
+    GifSplitImage *saved = AllocImage(handle, width, height,
+                                      canvas->IsTruecolor);
+    if (!saved)
+        return false;
+    handle->PrevCanvas = saved;
+    if (canvas->ColorMap && !ReplaceColorMap(saved, canvas->ColorMap))
+        return false;
+    saved->TransparentColorIndex = canvas->TransparentColorIndex;
+    handle->PrevCanvasLeft = left;
+    handle->PrevCanvasTop = top;
+    CopyRect(saved, 0, 0, canvas, left, top, width, height);
+    return true;
+}
+
+static bool RestorePrevious(GifSplitHandle *handle)
+{
+    GifSplitImage *saved = handle->PrevCanvas;
+    GifSplitImage *canvas = handle->Canvas;
+
+    if (!saved)
+        return true;
+    handle->PrevCanvas = NULL;
+
+    if (saved->Width == canvas->Width && saved->Height == canvas->Height) {
+        /* The whole canvas was saved, so just swap it back in */
+        FreeImage(handle, canvas);
+        handle->Canvas = saved;
+        return true;
+    }
+
+    /* The canvas may have switched to truecolor since. If so, bring the saved
+       area along; the rest of the canvas is unchanged either way. */
+    bool ok = true;
+    if (!canvas->IsTruecolor
+        && (saved->IsTruecolor || !SameColorMap(canvas->ColorMap,
+                                                saved->ColorMap)
+            || canvas->TransparentColorIndex != saved->TransparentColorIndex))
+        ok = ToTruecolor(handle, canvas);
+    if (ok && canvas->IsTruecolor)
+        ok = ToTruecolor(handle, saved);
+    if (ok)
+        CopyRect(canvas, handle->PrevCanvasLeft, handle->PrevCanvasTop,
+                 saved, 0, 0, saved->Width, saved->Height);
+    FreeImage(handle, saved);
+    return ok;
+}
+
 GifSplitHandle *GifSplitterOpen(GifFileType *gif)
 {
-    if (gif->SWidth <= 0 || gif->SHeight <= 0
-        || ((size_t)gif->SWidth * (size_t)gif->SHeight) > MAX_FRAME_SIZE) {
+    return GifSplitterOpenWithOptions(gif, NULL);
+}
+
+GifSplitHandle *GifSplitterOpenWithOptions(GifFileType *gif,
+                                           const GifSplitOptions *options)
+{
+    size_t max_pixels = GIF_SPLIT_DEFAULT_MAX_PIXELS;
+    if (options && options->MaxPixels)
+        max_pixels = options->MaxPixels;
+
+    if (gif->SWidth <= 0 || gif->SHeight <= 0)
         return NULL;
+
+    /* The canvas is the crop rectangle, clipped to the screen */
+    int left = 0, top = 0;
+    int width = gif->SWidth, height = gif->SHeight;
+    if (options && options->CropWidth > 0 && options->CropHeight > 0) {
+        left = options->CropLeft;
+        top = options->CropTop;
+        if (left < 0 || top < 0 || left >= width || top >= height)
+            return NULL;
+        if (options->CropWidth < width - left)
+            width = options->CropWidth;
+        else
+            width -= left;
+        if (options->CropHeight < height - top)
+            height = options->CropHeight;
+        else
+            height -= top;
     }
 
+    if ((size_t)width * (size_t)height > max_pixels)
+        return NULL;
+
     GifSplitHandle *handle = malloc(sizeof(GifSplitHandle));
     if (!handle)
         return NULL;
@@ -141,16 +328,29 @@ GifSplitHandle *GifSplitterOpen(GifFileType *gif)
 
     handle->File = gif;
     handle->Info.LoopCount = 1;
+    handle->CropLeft = left;
+    handle->CropTop = top;
+    handle->Cropped = width != gif->SWidth || height != gif->SHeight;
+
+    if (options && options->SpillDir) {
+        handle->SpillDir = strdup(options->SpillDir);
+        if (!handle->SpillDir) {
+            free(handle);
+            return NULL;
+        }
+    }
 
-    handle->ReadBuf = malloc(gif->SWidth * gif->SHeight);
+    handle->ReadBuf = malloc(MAX_ROW_SIZE);
     if (!handle->ReadBuf) {
+        free(handle->SpillDir);
         free(handle);
         return NULL;
     }
 
-    handle->Canvas = AllocImage(gif->SWidth, gif->SHeight, false);
+    handle->Canvas = AllocImage(handle, width, height, false);
     if (!handle->Canvas) {
         free(handle->ReadBuf);
+        free(handle->SpillDir);
         free(handle);
         return NULL;
     }
@@ -163,8 +363,8 @@ GifSplitHandle *GifSplitterOpen(GifFileType *gif)
      */
     handle->PrevImage.Left = 0;
     handle->PrevImage.Top = 0;
-    handle->PrevImage.Width = gif->SWidth;
-    handle->PrevImage.Height = gif->SHeight;
+    handle->PrevImage.Width = width;
+    handle->PrevImage.Height = height;
     handle->PrevFull = true;
     handle->PrevDisposal = GIF_DISPOSAL_BACKGROUND;
 
@@ -173,9 +373,10 @@ GifSplitHandle *GifSplitterOpen(GifFileType *gif)
 
 void GifSplitterClose(GifSplitHandle *handle)
 {
-    FreeImage(handle->Canvas);
-    FreeImage(handle->PrevCanvas);
+    FreeImage(handle, handle->Canvas);
+    FreeImage(handle, handle->PrevCanvas);
     free(handle->ReadBuf);
+    free(handle->SpillDir);
     DGifCloseFile(handle->File);
     free(handle);
 }
@@ -185,7 +386,169 @@ GifSplitInfo *GifSplitterGetInfo(GifSplitHandle *handle)
     return &handle->Info;
 }
 
-GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
+void GifSplitterSetBuiltinLZW(GifSplitHandle *handle, bool enable)
+{
+    handle->BuiltinLZW = enable;
+}
+
+/* Copy the pixels of p that are not t over q, eight at a time. Bytes equal
+ * to t are found without branches by XORing them to zero and testing every
+ * byte for zero in parallel. */
+static void MergeIndexedRow(GifPixelType *restrict q,
+                            const GifPixelType *restrict p,
+                            int width, GifPixelType t)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        uint64_t src, dst;
+        memcpy(&src, p + x, 8);
+        memcpy(&dst, q + x, 8);
+        uint64_t diff = src ^ (t * ones);
+        /* High bit of each byte set iff that byte of diff is nonzero */
+        uint64_t opaque = (((diff & low7) + low7) | diff) & ~low7;
+        uint64_t mask = (opaque >> 7) * 0xff;
+        dst = (src & mask) | (dst & ~mask);
+        memcpy(q + x, &dst, 8);
+    }
+    for (; x < width; x++)
+        q[x] = p[x] == t ? q[x] : p[x];
+}
+
+/* Compositing kernels, one per combination of canvas format and frame
+ * transparency. Clipping and disposal are dealt with before decoding, and the
+ * flags are constants, so each instance is a single loop without any per pixel
+ * tests other than the transparency select. An opaque indexed frame is a
+ * straight copy. */
+#define DEFINE_COMPOSE_KERNEL(name, truecolor, transparent)                 \
+static void name(const ComposeState *state, GifPixelType *restrict q,       \
+                 const GifPixelType *restrict p)                            \
+{                                                                           \
+    int width = state->Width;                                               \
+    /* Only used when there is a transparent index, so it fits a pixel */   \
+    GifPixelType t = state->TransparentColorIndex;                          \
+                                                                            \
+    if (!truecolor && !transparent) {                                       \
+        memcpy(q, p, width);                                                \
+    } else if (!truecolor) {                                                \
+        MergeIndexedRow(q, p, width, t);                                    \
+    } else {                                                                \
+        for (int x = 0; x < width; x++) {                                   \
+            uint32_t v;                                                     \
+            memcpy(&v, state->Palette[p[x]], 4);                            \
+            if (transparent) {                                              \
+                uint32_t old;                                               \
+                memcpy(&old, q + 4 * x, 4);                                 \
+                v = p[x] == t ? old : v;                                    \
+            }                                                               \
+            memcpy(q + 4 * x, &v, 4);                                       \
+        }                                                                   \
+    }                                                                       \
+}
+
+DEFINE_COMPOSE_KERNEL(ComposeIndexed, false, false)
+DEFINE_COMPOSE_KERNEL(ComposeIndexedTransparent, false, true)
+DEFINE_COMPOSE_KERNEL(ComposeTruecolor, true, false)
+DEFINE_COMPOSE_KERNEL(ComposeTruecolorTransparent, true, true)
+
+/* Pick the kernel for a frame, and set up the palette it needs */
+static void SetComposeKernel(ComposeState *state, ColorMapObject *map,
+                             bool truecolor)
+{
+    bool transparent = state->TransparentColorIndex != -1;
+
+    if (!truecolor) {
+        state->Compose = transparent ? ComposeIndexedTransparent
+                                     : ComposeIndexed;
+        return;
+    }
+
+    /* Indices past the end of the colormap are black */
+    for (int i = 0; i < 256; i++) {
+        GifColorType color = {0,0,0};
+        if (i < map->ColorCount)
+            color = map->Colors[i];
+        state->Palette[i][0] = color.Red;
+        state->Palette[i][1] = color.Green;
+        state->Palette[i][2] = color.Blue;
+        state->Palette[i][3] = 255;
+    }
+    state->Compose = transparent ? ComposeTruecolorTransparent
+                                 : ComposeTruecolor;
+}
+
+/* Apply one decoded row of the current frame to the canvas. Rows outside of
+ * the canvas are dropped. */
+static void ComposeRow(void *ctx, int row, GifPixelType *p)
+{
+    ComposeState *state = ctx;
+
+    row -= state->SrcTop;
+    if (row < 0 || row >= state->Height)
+        return;
+
+    state->Compose(state, GetPixel(state->Canvas, state->Left,
+                                   state->Top + row), p + state->SrcLeft);
+}
+
+/* Decode the current image using the built-in LZW decoder, feeding it the raw
+ * data sub-blocks from giflib. */
+static bool DecodeImageLZW(GifSplitHandle *handle, ComposeState *state)
+{
+    GifImageDesc *gif_img = &handle->File->Image;
+    GifByteType *block;
+    int code_size;
+
+    if (DGifGetCode(handle->File, &code_size, &block) == GIF_ERROR)
+        return false;
+    if (!GifLZWInit(&handle->LZW, code_size, gif_img->Width, gif_img->Height,
+                    gif_img->Interlace, handle->ReadBuf, ComposeRow, state))
+        return false;
+
+    while (block) {
+        if (!GifLZWDecode(&handle->LZW, block + 1, block[0]))
+            return false;
+        if (DGifGetCodeNext(handle->File, &block) == GIF_ERROR)
+            return false;
+    }
+    return GifLZWFinished(&handle->LZW);
+}
+
+/* Decode the current image line by line with giflib */
+static bool DecodeImageGifLib(GifSplitHandle *handle, ComposeState *state)
+{
+    GifImageDesc *gif_img = &handle->File->Image;
+
+    /* Deinterlace image, if necessary */
+    if (gif_img->Interlace) {
+        for (int i = 0; i < 4; i++) {
+            for (int y = InterlacedOffset[i]; y < gif_img->Height;
+                y += InterlacedJumps[i]) {
+                if (DGifGetLine(handle->File, handle->ReadBuf,
+                                gif_img->Width) == GIF_ERROR)
+                    return false;
+                ComposeRow(state, y, handle->ReadBuf);
+            }
+        }
+    } else {
+        for (int y = 0; y < gif_img->Height; y++) {
+            if (DGifGetLine(handle->File, handle->ReadBuf,
+                            gif_img->Width) == GIF_ERROR)
+                return false;
+            ComposeRow(state, y, handle->ReadBuf);
+        }
+    }
+    return true;
+}
+
+/* Read the records up to and including the next image descriptor, and return
+ * the frame parameters from its graphics control extension. Returns false at
+ * the end of the file, or on error with HasErrors set. */
+static bool ReadFrameRecords(GifSplitHandle *handle, GifWord *disposal_out,
+                             int *delay_time_out,
+                             GifWord *transparent_color_index_out)
 {
     GifWord transparent_color_index = -1;
     GifWord disposal = GIF_DISPOSAL_NONE;
@@ -200,7 +563,7 @@ GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
             goto fail;
 
         if (record_type == TERMINATE_RECORD_TYPE) {
-            return NULL;
+            return false;
         } else if (record_type == EXTENSION_RECORD_TYPE) {
             int ext_code;
             GifByteType *ext_data;
@@ -244,19 +607,106 @@ GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
     if (DGifGetImageDesc(handle->File) == GIF_ERROR)
         goto fail;
 
+    *disposal_out = disposal;
+    *delay_time_out = delay_time;
+    *transparent_color_index_out = transparent_color_index;
+    return true;
+
+fail:
+    handle->Info.HasErrors = true;
+    return false;
+}
+
+/* Work out which part of the canvas the current frame covers, in canvas
+ * coordinates, and whether that is all of it. Without cropping, that takes a
+ * frame that matches the screen exactly; when cropping, any frame that covers
+ * the crop rectangle will do. */
+static bool ClipFrame(GifSplitHandle *handle, ComposeState *area)
+{
     GifImageDesc *gif_img = &handle->File->Image;
+    int left = gif_img->Left - handle->CropLeft;
+    int top = gif_img->Top - handle->CropTop;
+    int right = left + gif_img->Width;
+    int bottom = top + gif_img->Height;
+
+    area->Left = left > 0 ? left : 0;
+    area->Top = top > 0 ? top : 0;
+    area->SrcLeft = area->Left - left;
+    area->SrcTop = area->Top - top;
+    if (right > handle->Canvas->Width)
+        right = handle->Canvas->Width;
+    if (bottom > handle->Canvas->Height)
+        bottom = handle->Canvas->Height;
+    area->Width = right > area->Left ? right - area->Left : 0;
+    area->Height = bottom > area->Top ? bottom - area->Top : 0;
+
+    if (!handle->Cropped)
+        return left == 0 && top == 0
+               && gif_img->Width == handle->Canvas->Width
+               && gif_img->Height == handle->Canvas->Height;
+    return left <= 0 && top <= 0 && right == handle->Canvas->Width
+           && bottom == handle->Canvas->Height;
+}
 
-    bool is_full = false;
+/* Skip over the image data of the current frame */
+static bool SkipImage(GifSplitHandle *handle)
+{
+    GifByteType *block;
+    int code_size;
 
-    if (gif_img->Top == 0 && gif_img->Left == 0
-        && gif_img->Width == handle->File->SWidth
-        && gif_img->Height == handle->File->SHeight)
-        is_full = true;
+    if (DGifGetCode(handle->File, &code_size, &block) == GIF_ERROR)
+        return false;
+    while (block) {
+        if (DGifGetCodeNext(handle->File, &block) == GIF_ERROR)
+            return false;
+    }
+    return true;
+}
+
+bool GifSplitterSkipFrame(GifSplitHandle *handle, bool *keyframe)
+{
+    GifWord transparent_color_index;
+    GifWord disposal;
+    int delay_time;
+
+    if (!ReadFrameRecords(handle, &disposal, &delay_time,
+                          &transparent_color_index))
+        return false;
 
-    int frame_width = gif_img->Width;
-    int frame_height = gif_img->Height;
+    /* A full frame replaces the whole canvas if it is opaque, or if the canvas
+    was cleared by the previous frame. Unless it is then disposed to previous,
+    nothing before it matters after it either. The disposal is adjusted the
+    same way as in GifSplitterReadFrame, and tracked just for this. */
+    ComposeState area;
+    bool is_full = ClipFrame(handle, &area);
+    bool cleared = handle->PrevDisposal == GIF_DISPOSAL_BACKGROUND
+                   && handle->PrevFull;
+    if (cleared && disposal == GIF_DISPOSAL_PREVIOUS)
+        disposal = GIF_DISPOSAL_BACKGROUND;
+    if (keyframe)
+        *keyframe = is_full && (transparent_color_index == -1 || cleared)
+                    && disposal != GIF_DISPOSAL_PREVIOUS;
+    handle->PrevDisposal = disposal;
+    handle->PrevFull = is_full;
 
-    bool over_size = false;
+    if (!SkipImage(handle)) {
+        handle->Info.HasErrors = true;
+        return false;
+    }
+    return true;
+}
+
+GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
+{
+    GifWord transparent_color_index;
+    GifWord disposal;
+    int delay_time;
+
+    if (!ReadFrameRecords(handle, &disposal, &delay_time,
+                          &transparent_color_index))
+        return NULL;
+
+    GifImageDesc *gif_img = &handle->File->Image;
 
     /* Sanity check */
     if (gif_img->Top < 0 || gif_img->Left < 0
@@ -265,26 +715,35 @@ GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
         || gif_img->Left >= handle->File->SWidth)
         goto fail;
 
-    if ((gif_img->Left + gif_img->Width) > handle->File->SWidth) {
-        frame_width = handle->File->SWidth - gif_img->Left;
-        over_size = true;
-    }
-    if ((gif_img->Top + gif_img->Height) > handle->File->SHeight) {
-        frame_height = handle->File->SHeight - gif_img->Top;
-        over_size = true;
-    }
+    if ((gif_img->Left + gif_img->Width) > handle->File->SWidth
+        || (gif_img->Top + gif_img->Height) > handle->File->SHeight)
+        fprintf(stderr, "Warn: oversize GIF frame (%dx%d+%d+%d)\n",
+                gif_img->Width, gif_img->Height, gif_img->Left, gif_img->Top);
 
-    if (over_size && (gif_img->Width * gif_img->Height) > MAX_FRAME_SIZE)
-        goto fail;
+    /* The part of the canvas that the frame covers */
+    ComposeState state;
+    bool is_full = ClipFrame(handle, &state);
+    bool visible = state.Width > 0 && state.Height > 0;
+
+    /* Whether the canvas may differ from the last frame returned */
+    bool changed = visible;
+
+    ColorMapObject *gif_map = gif_img->ColorMap;
+    if (!gif_map) {
+        gif_map = handle->File->SColorMap;
+        if (!gif_map)
+            goto fail;
+    }
 
     /* Need to merge if the image is not the whole canvas, or it has
     transparent holes. */
     bool merge = !is_full || transparent_color_index != -1;
 
     if (handle->PrevDisposal == GIF_DISPOSAL_PREVIOUS) {
-        FreeImage(handle->Canvas);
-        handle->Canvas = handle->PrevCanvas;
-        handle->PrevCanvas = NULL;
+        if (handle->PrevCanvas)
+            changed = true;
+        if (!RestorePrevious(handle))
+            goto fail;
     } else if (handle->PrevDisposal == GIF_DISPOSAL_BACKGROUND) {
         /* Really means clear to transparent, these days. */
         if (handle->PrevFull) {
@@ -304,89 +763,40 @@ GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
             if (handle->Canvas->TransparentColorIndex == -1) {
                 /* Evil! Need a transparent background but no transparent index.
                 Punt and switch to truecolor mode. */
-                if (!ToTruecolor(handle->Canvas))
+                if (!ToTruecolor(handle, handle->Canvas))
                     goto fail;
             }
             GifPixelType clear_value = (handle->Canvas->IsTruecolor ? 0 :
                                         handle->Canvas->TransparentColorIndex);
             int pixel_size = handle->Canvas->IsTruecolor ? 4 : 1;
 
-            GifPixelType *p = (handle->Canvas->RasterData
-                               + pixel_size * (handle->PrevImage.Left
-                                               + handle->Canvas->Width
-                                               * handle->PrevImage.Top));
+            if (handle->PrevImage.Width > 0 && handle->PrevImage.Height > 0)
+                changed = true;
             for (int y = 0; y < handle->PrevImage.Height; y++) {
-                memset(p, clear_value, handle->PrevImage.Width * pixel_size);
-                p += handle->Canvas->Width * pixel_size;
+                memset(GetPixel(handle->Canvas, handle->PrevImage.Left,
+                                handle->PrevImage.Top + y),
+                       clear_value, handle->PrevImage.Width * pixel_size);
             }
         }
     }
 
-    /* Save a copy of the canvas if we need to dispose to previous */
+    /* Save the area under the frame if we need to dispose to previous */
     if (disposal == GIF_DISPOSAL_PREVIOUS) {
-        FreeImage(handle->PrevCanvas);
-        handle->PrevCanvas = CloneImage(handle->Canvas);
-        if (!handle->PrevCanvas)
+        if (!SavePrevious(handle, state.Left, state.Top,
+                          state.Width, state.Height))
             goto fail;
     }
 
-    GifPixelType *p = handle->ReadBuf;
-
-    if (over_size) {
-        p = malloc(gif_img->Width * gif_img->Height);
-        fprintf(stderr, "Warn: oversize GIF frame (%dx%d+%d+%d)\n",
-                gif_img->Width, gif_img->Height, gif_img->Left, gif_img->Top);
-    }
-
-    /* Deinterlace image, if necessary */
-    if (gif_img->Interlace) {
-        for (int i = 0; i < 4; i++) {
-            for (int y = InterlacedOffset[i]; y < gif_img->Height;
-                y += InterlacedJumps[i]) {
-                if (DGifGetLine(handle->File, p + gif_img->Width * y,
-                                gif_img->Width) == GIF_ERROR)
-                    goto fail;
-            }
-        }
-    } else {
-        for (int y = 0; y < gif_img->Height; y++) {
-            if (DGifGetLine(handle->File, p + gif_img->Width * y,
-                            gif_img->Width) == GIF_ERROR)
-                goto fail;
-        }
-    }
+    state.TransparentColorIndex = transparent_color_index;
 
-    if (over_size) {
-        GifPixelType *buf = p;
-        GifPixelType *q = p;
-        p = handle->ReadBuf;
-        for (int y = 0; y < frame_height; y++) {
-            memcpy(p, q, frame_width);
-            q += gif_img->Width;
-            p += frame_width;
-        }
-        p = handle->ReadBuf;
-        free(buf);
-    }
-
-    ColorMapObject *gif_map = gif_img->ColorMap;
-    if (!gif_map) {
-        handle->Canvas->UsedLocalColormap = false;
-        gif_map = handle->File->SColorMap;
-        if (!gif_map)
-            goto fail;
-    } else {
-        handle->Canvas->UsedLocalColormap = true;
-    }
-
-    /* Now apply it to the canvas */
+    /* Now work out how to apply it to the canvas */
     if (!merge) {
+        changed = true;
         /* The easy case: no merging */
         if (is_full && !forceTrueColor) {
             /* Easy, just copy everything */
-            handle->Canvas->IsTruecolor = false;
-            memcpy(handle->Canvas->RasterData, p,
-                frame_width * frame_height);
+            if (!ResetImage(handle, &handle->Canvas, false))
+                goto fail;
             if (!ReplaceColorMap(handle->Canvas, gif_map))
                 goto fail;
             handle->Canvas->TransparentColorIndex = transparent_color_index;
@@ -394,26 +804,17 @@ GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
             if (transparent_color_index == -1 || forceTrueColor) {
                 /* Evil! Need transparent padding but no transparent color.
                 Punt and switch to truecolor, then perform a truecolor merge. */
-                if (!handle->Canvas->IsTruecolor) {
-                    FreeImage(handle->Canvas);
-                    handle->Canvas = AllocImage(handle->File->SWidth,
-                                                handle->File->SHeight, true);
-                }
+                if (!ResetImage(handle, &handle->Canvas, true))
+                    goto fail;
                 memset(handle->Canvas->RasterData, 0,
                        GetImageSize(handle->Canvas));
                 merge = true;
             } else {
                 /* Reset the canvas to transparent and copy the subimage */
-                handle->Canvas->IsTruecolor = false;
+                if (!ResetImage(handle, &handle->Canvas, false))
+                    goto fail;
                 memset(handle->Canvas->RasterData, transparent_color_index,
                        GetImageSize(handle->Canvas));
-                GifPixelType *q = (handle->Canvas->RasterData + gif_img->Left
-                                   + gif_img->Top * handle->Canvas->Width);
-                for (int y = 0; y < frame_height; y++) {
-                    memcpy(q, p, frame_width);
-                    q += handle->Canvas->Width;
-                    p += frame_width;
-                }
                 if (!ReplaceColorMap(handle->Canvas, gif_map))
                     goto fail;
                 handle->Canvas->TransparentColorIndex = transparent_color_index;
@@ -422,63 +823,52 @@ GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle, bool forceTrueColor)
     }
 
     if (merge) {
-        if (!handle->Canvas->IsTruecolor) {
+        /* Frames entirely outside of the canvas do not change it, so they
+        need not match its colormap */
+        if (!handle->Canvas->IsTruecolor && (visible || forceTrueColor)) {
             assert(handle->Canvas->ColorMap);
-            ColorMapObject *canvas_map = handle->Canvas->ColorMap;
-            if (canvas_map->ColorCount != gif_map->ColorCount
-                || memcmp(canvas_map->Colors, gif_map->Colors,
-                          sizeof(GifColorType) * gif_map->ColorCount)
+            if (!SameColorMap(handle->Canvas->ColorMap, gif_map)
                 || (handle->Canvas->TransparentColorIndex
                     != transparent_color_index)
                 || forceTrueColor) {
                 /* Colormaps differ. We could attempt to merge them if
                 possible, but for now, let's just punt to truecolor mode. */
-                if (!ToTruecolor(handle->Canvas))
+                if (!ToTruecolor(handle, handle->Canvas))
                     goto fail;
-            } else {
-                /* Same colormaps, so we can just merge */
-                GifPixelType *q = (handle->Canvas->RasterData + gif_img->Left
-                                   + gif_img->Top * handle->Canvas->Width);
-                for (int y = 0; y < frame_height; y++) {
-                    for (int x = 0; x < frame_width; x++) {
-                        if (*p != transparent_color_index)
-                            *q = *p;
-                        q++;
-                        p++;
-                    }
-                    q += handle->Canvas->Width - frame_width;
-                }
-            }
-        }
-        if (handle->Canvas->IsTruecolor) {
-            GifPixelType *q = (handle->Canvas->RasterData + 4 * gif_img->Left
-                               + 4 * gif_img->Top * handle->Canvas->Width);
-            for (int y = 0; y < frame_height; y++) {
-                for (int x = 0; x < frame_width; x++) {
-                    if (*p != transparent_color_index) {
-                        GifColorType color = {0,0,0};
-                        if (*p < gif_map->ColorCount)
-                            color = gif_map->Colors[*p];
-                        *q++ = color.Red;
-                        *q++ = color.Green;
-                        *q++ = color.Blue;
-                        *q++ = 255;
-                    } else {
-                        q += 4;
-                    }
-                    p++;
-                }
-                q += (handle->Canvas->Width - frame_width) * 4;
+                changed = true;
             }
+            /* Otherwise, same colormaps, so we can just merge */
         }
+    } else {
+        /* Copy everything, transparent pixels included */
+        state.TransparentColorIndex = -1;
+    }
+    SetComposeKernel(&state, gif_map, handle->Canvas->IsTruecolor);
+
+    /* Decode the image, applying each row to the canvas as it comes in. If
+    none of it is on the canvas, just skip over it. */
+    state.Canvas = handle->Canvas;
+    if (!visible) {
+        if (!SkipImage(handle))
+            goto fail;
+    } else if (handle->BuiltinLZW) {
+        if (!DecodeImageLZW(handle, &state))
+            goto fail;
+    } else {
+        if (!DecodeImageGifLib(handle, &state))
+            goto fail;
     }
 
+    handle->Canvas->UsedLocalColormap = gif_img->ColorMap != NULL;
     handle->PrevDisposal = disposal;
     handle->PrevImage = *gif_img;
-    handle->PrevImage.Height = frame_height;
-    handle->PrevImage.Width = frame_width;
+    handle->PrevImage.Left = state.Left;
+    handle->PrevImage.Top = state.Top;
+    handle->PrevImage.Width = state.Width;
+    handle->PrevImage.Height = state.Height;
     handle->PrevFull = is_full;
     handle->Canvas->DelayTime = delay_time;
+    handle->Canvas->Unchanged = !changed;
 
     return handle->Canvas;
 
@@ -2,6 +2,7 @@
 #define LIBGIFSPLIT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <gif_lib.h>
 
@@ -12,11 +13,14 @@ typedef struct GifSplitHandle_t GifSplitHandle;
 #define GIF_DISPOSAL_BACKGROUND 2
 #define GIF_DISPOSAL_PREVIOUS 3
 
+/* Default sanity/safety limit: no gifs larger than 10 megapixels per frame */
+#define GIF_SPLIT_DEFAULT_MAX_PIXELS 10000000
+
 typedef uint16_t GifSize;
 
 typedef struct GifSplitImage_t {
     GifSize Width, Height;      /* Always the same as the GifFileType's SWidth
-                                   and SHeight */
+                                   and SHeight, or the crop rectangle's size */
     bool IsTruecolor;           /* Is this a truecolor frame (>255 colors?) */
     ColorMapObject *ColorMap;   /* Colormap for this frame, NULL if truecolor */
     GifWord TransparentColorIndex; /* Transparent color index, or -1 if none */
@@ -26,6 +30,8 @@ typedef struct GifSplitImage_t {
                                    is equal to the Width * Height */
     GifWord DelayTime;          /* Delay time for this frame, in 1/100s units */
     bool UsedLocalColormap;     /* Whether this image used a local colormap */
+    bool Unchanged;             /* Whether the pixels are known to be the same
+                                   as in the previous frame */
 
 } GifSplitImage;
 
@@ -36,6 +42,19 @@ typedef struct GifSplitInfo_t {
                                    the image */
 } GifSplitInfo;
 
+typedef struct GifSplitOptions_t {
+    size_t MaxPixels;           /* Largest canvas to accept, in pixels. 0 means
+                                   GIF_SPLIT_DEFAULT_MAX_PIXELS */
+    const char *SpillDir;       /* If set, large rasters are kept in unlinked
+                                   temporary files in this directory and
+                                   mapped into memory, instead of in anonymous
+                                   memory */
+    int CropLeft, CropTop;      /* Top left corner of the part of the screen
+                                   to return frames of */
+    int CropWidth, CropHeight;  /* Size of that part, clipped to the screen;
+                                   0 means the whole screen */
+} GifSplitOptions;
+
 /*
  * Initialize a GIF Splitter context.
  *
@@ -44,6 +63,19 @@ typedef struct GifSplitInfo_t {
  */
 GifSplitHandle *GifSplitterOpen(GifFileType *gif);
 
+/*
+ * Initialize a GIF Splitter context with non-default options.
+ *
+ * Same as GifSplitterOpen. options may be NULL to use the defaults.
+ *
+ * Memory use is dominated by the canvas (one byte per pixel, or four in
+ * truecolor mode), plus a copy of the area under the current frame if it is
+ * disposed to previous. Frames are composed onto the canvas row by row as they
+ * are decoded.
+ */
+GifSplitHandle *GifSplitterOpenWithOptions(GifFileType *gif,
+                                           const GifSplitOptions *options);
+
 /*
  * Release a GIF Splitter context.
  *
@@ -60,6 +92,18 @@ void GifSplitterClose(GifSplitHandle *handle);
  */
 GifSplitInfo *GifSplitterGetInfo(GifSplitHandle *handle);
 
+/*
+ * Select the LZW decoder.
+ *
+ * By default, image data is decoded line by line with giflib's DGifGetLine.
+ * If enable is true, the built-in decoder is used instead. It is fed the raw
+ * data sub-blocks and expands its codes straight into a row buffer, several
+ * bytes of a string at a time, composing each row onto the canvas as soon as
+ * it is complete, in the order the rows are stored in for interlaced images.
+ * giflib is still used to parse the file structure either way.
+ */
+void GifSplitterSetBuiltinLZW(GifSplitHandle *handle, bool enable);
+
 /*
  * Fetch a frame from the source GIF
  *
@@ -71,12 +115,32 @@ GifSplitInfo *GifSplitterGetInfo(GifSplitHandle *handle);
  *
  * The returned image comprises the entire canvas area of the gif as it should
  * be displayed at a particular frame. Its dimensions are the screen dimensions
- * as specified in the GifFileType object. The disposal is provided for
- * informational purposes only.
+ * as specified in the GifFileType object, unless a crop rectangle was given
+ * in the options: then it is only that part of the canvas, and its dimensions
+ * are those of the crop rectangle after clipping to the screen. The disposal
+ * is provided for informational purposes only.
  *
  * Returns NULL if an error occured.
  */
 GifSplitImage *GifSplitterReadFrame(GifSplitHandle *handle,
                                     bool forceTrueColor);
 
+/*
+ * Skip over the next frame without decoding it.
+ *
+ * Parses the records of the next frame and skips its image data. If keyframe
+ * is not NULL, it is set to whether the frame is a keyframe: one that covers
+ * the whole canvas, is not disposed to previous, and either has no
+ * transparency or follows a full frame disposed to background. Neither it nor
+ * any later frame then depends on earlier frames, so a fresh context whose
+ * input starts at the records of a keyframe produces the same frames from
+ * there on as one that read the whole file.
+ *
+ * Skipped frames are not composed, so this is meant for scanning a file ahead
+ * of time; a context should not be used to read frames after skipping some.
+ *
+ * Returns false at the end of the file or if an error occured.
+ */
+bool GifSplitterSkipFrame(GifSplitHandle *handle, bool *keyframe);
+
 #endif
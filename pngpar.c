@@ -0,0 +1,344 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "pngpar.h"
+
+/* Uncompressed bytes per block, as in pigz */
+#define BLOCK_SIZE 131072
+
+/* Size of the deflate window, and so of the dictionary worth priming each
+block with */
+#define DICT_SIZE 32768
+
+/* Compressed output of one block */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    uLong adler;                /* Adler-32 of the uncompressed block */
+    size_t in_size;
+} pngpar_block;
+
+typedef struct {
+    const pngpar_image *img;
+    size_t row_bytes;           /* Row size, without the filter type byte */
+    const uint8_t *zero_row;    /* Stands in for the row above the first */
+    int rows_per_block;
+    int blocks;
+
+    pthread_mutex_t lock;       /* Protects next and failed */
+    int next;
+    bool failed;
+
+    pngpar_block *results;
+} pngpar_job;
+
+static uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+/* Sum of the filtered bytes taken as signed values, which libpng uses to
+guess which filter will compress best */
+static unsigned long filter_cost(const uint8_t *p, size_t len)
+{
+    unsigned long sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += p[i] < 128 ? p[i] : 256 - p[i];
+    return sum;
+}
+
+/* Filter row y into out, preceded by its filter type. Palette rows are
+packed and left unfiltered; RGBA rows get whichever filter has the lowest
+cost, like libpng does by default. scratch must have room for four rows, or
+for one row of unpacked palette indices if that is larger. */
+static void filter_row(const pngpar_job *job, int y, uint8_t *out,
+                       uint8_t *scratch)
+{
+    const pngpar_image *img = job->img;
+    const uint8_t *cur = scratch;
+    size_t len = job->row_bytes;
+
+    if (img->read_row)
+        img->read_row(img->row_ctx, y, scratch);
+    else
+        cur = img->pixels + y * img->stride;
+
+    if (img->palette) {
+        out[0] = 0;
+        if (img->bit_depth == 8) {
+            memcpy(out + 1, cur, len);
+            return;
+        }
+        int per_byte = 8 / img->bit_depth;
+        memset(out + 1, 0, len);
+        for (int x = 0; x < img->width; x++) {
+            int shift = 8 - img->bit_depth * (x % per_byte + 1);
+            out[1 + x / per_byte] |= cur[x] << shift;
+        }
+        return;
+    }
+
+    const uint8_t *prev = y ? cur - img->stride : job->zero_row;
+    uint8_t *sub = scratch, *up = sub + len, *avg = up + len;
+    uint8_t *pae = avg + len;
+    for (size_t i = 0; i < len; i++) {
+        int a = i >= 4 ? cur[i - 4] : 0;
+        int b = prev[i];
+        int c = i >= 4 ? prev[i - 4] : 0;
+        sub[i] = cur[i] - a;
+        up[i] = cur[i] - b;
+        avg[i] = cur[i] - ((a + b) >> 1);
+        pae[i] = cur[i] - paeth(a, b, c);
+    }
+
+    const uint8_t *candidates[5] = { cur, sub, up, avg, pae };
+    int best = 0;
+    unsigned long best_cost = filter_cost(cur, len);
+    for (int f = 1; f < 5; f++) {
+        unsigned long cost = filter_cost(candidates[f], len);
+        if (cost < best_cost) {
+            best = f;
+            best_cost = cost;
+        }
+    }
+    out[0] = best;
+    memcpy(out + 1, candidates[best], len);
+}
+
+/* Filter and compress one block. All but the last block end with a sync
+flush, which leaves the stream on a byte boundary so that the next block's
+output can simply be appended. */
+static bool compress_block(pngpar_job *job, int block, uint8_t *scratch)
+{
+    const pngpar_image *img = job->img;
+    size_t filtered = job->row_bytes + 1;
+    int first = block * job->rows_per_block;
+    int rows = img->height - first;
+    if (rows > job->rows_per_block)
+        rows = job->rows_per_block;
+    int dict_rows = (DICT_SIZE + filtered - 1) / filtered;
+    if (dict_rows > first)
+        dict_rows = first;
+
+    /* The rows that make up the dictionary are filtered again here, so that
+    blocks do not have to wait for each other */
+    uint8_t *in = malloc((dict_rows + rows) * filtered);
+    if (!in)
+        return false;
+    for (int i = 0; i < dict_rows + rows; i++)
+        filter_row(job, first - dict_rows + i, in + i * filtered, scratch);
+
+    pngpar_block *result = &job->results[block];
+    uint8_t *start = in + dict_rows * filtered;
+    result->in_size = rows * filtered;
+    result->adler = adler32(adler32(0, NULL, 0), start, result->in_size);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     img->palette ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK) {
+        free(in);
+        return false;
+    }
+    if (dict_rows) {
+        size_t dict_size = dict_rows * filtered;
+        if (dict_size > DICT_SIZE)
+            dict_size = DICT_SIZE;
+        deflateSetDictionary(&zs, start - dict_size, dict_size);
+    }
+
+    size_t alloc = deflateBound(&zs, result->in_size) + 64;
+    result->data = malloc(alloc);
+    zs.next_in = start;
+    zs.avail_in = result->in_size;
+    zs.next_out = result->data;
+    zs.avail_out = alloc;
+    int flush = block == job->blocks - 1 ? Z_FINISH : Z_SYNC_FLUSH;
+    bool ok = result->data != NULL;
+    while (ok) {
+        int ret = deflate(&zs, flush);
+        if (ret == Z_STREAM_END || (ret == Z_OK && flush == Z_SYNC_FLUSH
+                                    && zs.avail_out))
+            break;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            ok = false;
+            break;
+        }
+        /* Out of room, which the bound should make impossible */
+        uint8_t *p = realloc(result->data, 2 * alloc);
+        if (!p) {
+            ok = false;
+            break;
+        }
+        result->data = p;
+        zs.next_out = p + zs.total_out;
+        zs.avail_out = 2 * alloc - zs.total_out;
+        alloc *= 2;
+    }
+    result->size = zs.total_out;
+    deflateEnd(&zs);
+    free(in);
+    return ok;
+}
+
+static void *compress_thread(void *arg)
+{
+    pngpar_job *job = arg;
+    size_t scratch_size = 4 * job->row_bytes;
+    if (scratch_size < (size_t)job->img->width)
+        scratch_size = job->img->width;
+    uint8_t *scratch = malloc(scratch_size);
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int block = job->next++;
+        if (!scratch)
+            job->failed = true;
+        bool stop = job->failed || block >= job->blocks;
+        pthread_mutex_unlock(&job->lock);
+        if (stop)
+            break;
+
+        if (!compress_block(job, block, scratch)) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = true;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    free(scratch);
+    return NULL;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+/* Finish a chunk whose type starts at start, given the end of its data:
+fill in the length in front of it and append the CRC */
+static uint8_t *end_chunk(uint8_t *start, uint8_t *end)
+{
+    put32(start - 4, end - start - 4);
+    return put32(end, crc32(0, start, end - start));
+}
+
+static uint8_t *put_chunk(uint8_t *p, const char *type, const uint8_t *data,
+                          size_t len)
+{
+    uint8_t *start = p + 4;
+    memcpy(start, type, 4);
+    if (len)
+        memcpy(start + 4, data, len);
+    return end_chunk(start, start + 4 + len);
+}
+
+bool pngpar_encode(const pngpar_image *img, int threads, void **data,
+                   size_t *size)
+{
+    pngpar_job job;
+    memset(&job, 0, sizeof(job));
+    job.img = img;
+    job.row_bytes = img->palette
+                    ? ((size_t)img->width * img->bit_depth + 7) / 8
+                    : 4 * (size_t)img->width;
+    job.rows_per_block = BLOCK_SIZE / (job.row_bytes + 1);
+    if (job.rows_per_block < 1)
+        job.rows_per_block = 1;
+    job.blocks = (img->height + job.rows_per_block - 1) / job.rows_per_block;
+    job.zero_row = calloc(1, job.row_bytes);
+    job.results = calloc(job.blocks, sizeof(pngpar_block));
+    if (!job.zero_row || !job.results) {
+        free((void *)job.zero_row);
+        free(job.results);
+        return false;
+    }
+
+    if (threads > job.blocks)
+        threads = job.blocks;
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    pthread_mutex_init(&job.lock, NULL);
+    int started = 0;
+    while (tids && started < threads - 1
+           && !pthread_create(&tids[started], NULL, compress_thread, &job))
+        started++;
+    compress_thread(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    free(tids);
+
+    /* The zlib stream is the header, the blocks and the combined Adler-32 */
+    size_t out_size = 8 + 25 + 12;
+    if (img->palette)
+        out_size += 12 + 3 * img->color_count;
+    if (img->alpha)
+        out_size += 12 + img->alpha_count;
+    out_size += 2 + 4;
+    uLong adler = adler32(0, NULL, 0);
+    for (int i = 0; i < job.blocks; i++) {
+        out_size += 12 + job.results[i].size;
+        adler = adler32_combine(adler, job.results[i].adler,
+                                job.results[i].in_size);
+    }
+
+    uint8_t *out = job.failed ? NULL : malloc(out_size);
+    if (out) {
+        static const uint8_t signature[8] = {
+            0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+        };
+        uint8_t ihdr[13];
+        put32(ihdr, img->width);
+        put32(ihdr + 4, img->height);
+        ihdr[8] = img->palette ? img->bit_depth : 8;
+        ihdr[9] = img->palette ? 3 : 6;
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+        uint8_t *p = out;
+        memcpy(p, signature, 8);
+        p = put_chunk(p + 8, "IHDR", ihdr, 13);
+        if (img->palette)
+            p = put_chunk(p, "PLTE", img->colors, 3 * img->color_count);
+        if (img->alpha)
+            p = put_chunk(p, "tRNS", img->alpha, img->alpha_count);
+
+        /* One IDAT per block, with the zlib header in the first and the
+        checksum in the last */
+        for (int i = 0; i < job.blocks; i++) {
+            uint8_t *start = p + 4;
+            p = start;
+            memcpy(p, "IDAT", 4);
+            p += 4;
+            if (!i) {
+                *p++ = 0x78;
+                *p++ = 0x9c;
+            }
+            memcpy(p, job.results[i].data, job.results[i].size);
+            p += job.results[i].size;
+            if (i == job.blocks - 1)
+                p = put32(p, adler);
+            p = end_chunk(start, p);
+        }
+        p = put_chunk(p, "IEND", NULL, 0);
+
+        *data = out;
+        *size = p - out;
+    }
+
+    for (int i = 0; i < job.blocks; i++)
+        free(job.results[i].data);
+    free(job.results);
+    free((void *)job.zero_row);
+    return out != NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef PNGPAR_H
+#define PNGPAR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Parallel PNG encoder.
+ *
+ * Encodes a whole image into memory with several threads, for images large
+ * enough that compressing them on one core takes a while. The filtered
+ * scanlines are cut into blocks which are compressed concurrently as
+ * independent pieces of one deflate stream, each primed with the end of the
+ * block before it as its dictionary so that little is lost in compression,
+ * the same way pigz does it. The pieces are then stitched together into a
+ * single zlib stream, with its Adler-32 combined from those of the blocks,
+ * and written out as the IDAT chunks of an ordinary PNG file.
+ */
+typedef struct {
+    int width, height;
+    int bit_depth;              /* 1, 2, 4 or 8 */
+    bool palette;               /* Palette image, else 8-bit RGBA */
+    const uint8_t *pixels;      /* One byte per palette index, or four per
+                                   pixel for RGBA, unpacked */
+    size_t stride;              /* Bytes from one row of pixels to the next */
+    /* Alternatively, for palette images, a function that stores the indices
+       of row y into out, one byte per pixel, and its first argument. It may
+       be called from several threads at once. */
+    void (*read_row)(const void *ctx, int y, uint8_t *out);
+    const void *row_ctx;
+    const uint8_t *colors;      /* Palette, as RGB triples */
+    int color_count;
+    const uint8_t *alpha;       /* Palette alpha (tRNS) entries, or NULL */
+    int alpha_count;
+} pngpar_image;
+
+/*
+ * Encode img as a PNG file with up to threads threads. On success, *data is
+ * set to the file contents, allocated with malloc, and *size to its length.
+ * Returns false if out of memory.
+ */
+bool pngpar_encode(const pngpar_image *img, int threads, void **data,
+                   size_t *size);
+
+#endif
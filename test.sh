@@ -60,6 +60,555 @@ testgif() {
     return 0
 }
 
+# Run gifsplit on a gif with the giflib and built-in LZW decoders. If the
+# giflib run succeeds, the built-in decoder must produce identical output.
+# Either way, it must not crash.
+comparelzw() {
+    local gif="$1" tmp=$(mktemp -d) libret lzwret
+
+    set +e
+    $gifsplit "$gif" "$tmp/lib-" >"$tmp/lib.stdout" 2>/dev/null
+    libret=$?
+    $gifsplit -l "$gif" "$tmp/lzw-" >"$tmp/lzw.stdout" 2>/dev/null
+    lzwret=$?
+    set -e
+
+    if [ "$lzwret" -ge 128 ] ; then
+        echo "Built-in decoder crashed on $gif"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+    if [ "$libret" == "0" ] ; then
+        if [ "$lzwret" != "0" ] ; then
+            echo "Built-in decoder failed on $gif"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        if ! cmp -s "$tmp/lib.stdout" "$tmp/lzw.stdout" ; then
+            echo "Output mismatch on $gif"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        for out in "$tmp"/lib-*.png; do
+            if ! cmp -s "$out" "${out/lib-/lzw-}" ; then
+                echo "Frame mismatch on $gif: $out"
+                echo "Temp dir: $tmp"
+                return 1
+            fi
+        done
+    fi
+
+    rm -rf "$tmp"
+    return 0
+}
+
+# Corrupt a few random bytes past the GIF header
+fuzzgif() {
+    local size offset
+    cp "$1" "$2"
+    size=$(stat -c %s "$2")
+    for i in $(seq $((RANDOM % 4 + 1))); do
+        offset=$(( 13 + (RANDOM * 32768 + RANDOM) % (size - 13) ))
+        printf "\\x$(printf %02x $((RANDOM % 256)))" | \
+            dd of="$2" bs=1 seek=$offset conv=notrunc status=none
+    done
+}
+
+testlzw() {
+    local gif="$1" fuzz
+    echo -n "Testing built-in LZW decoder on $gif... "
+    comparelzw "$gif" || return 1
+
+    fuzz=$(mktemp)
+    for i in $(seq 20); do
+        fuzzgif "$gif" "$fuzz"
+        if ! comparelzw "$fuzz" ; then
+            cp "$fuzz" "$fuzz.gif"
+            echo "Fuzzed input: $fuzz.gif"
+            return 1
+        fi
+    done
+    rm -f "$fuzz"
+    echo "OK"
+    return 0
+}
+
+# Run gifsplit on a gif sequentially and with keyframe splitting. Both runs
+# must exit the same way and leave the same output behind.
+compareparallel() {
+    local gif="$1" tmp=$(mktemp -d) seqret parret
+
+    set +e
+    mkdir "$tmp/seq" "$tmp/par"
+    $gifsplit "$gif" "$tmp/seq/out-" >"$tmp/seq.stdout" 2>/dev/null
+    seqret=$?
+    $gifsplit -j 4 "$gif" "$tmp/par/out-" >"$tmp/par.stdout" 2>/dev/null
+    parret=$?
+    set -e
+
+    if [ "$seqret" != "$parret" ] ; then
+        echo "Exit code mismatch on $gif: $seqret vs. $parret"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+    if ! cmp -s "$tmp/seq.stdout" "$tmp/par.stdout" ||
+       ! diff -r "$tmp/seq" "$tmp/par" >/dev/null ; then
+        echo "Output mismatch on $gif"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    rm -rf "$tmp"
+    return 0
+}
+
+testparallel() {
+    local gif="$1" fuzz
+    echo -n "Testing keyframe splitting on $gif... "
+    compareparallel "$gif" || return 1
+
+    fuzz=$(mktemp)
+    for i in $(seq 5); do
+        fuzzgif "$gif" "$fuzz"
+        if ! compareparallel "$fuzz" ; then
+            cp "$fuzz" "$fuzz.gif"
+            echo "Fuzzed input: $fuzz.gif"
+            return 1
+        fi
+    done
+    rm -f "$fuzz"
+    echo "OK"
+    return 0
+}
+
+# Crop part of every frame. Each cropped frame must match the same part of
+# the full frame.
+testcrop() {
+    local gif="$1" tmp=$(mktemp -d) out
+    echo -n "Testing cropping on $gif... "
+
+    $gifsplit "$gif" "$tmp/full-" >"$tmp/full.stdout"
+    $gifsplit -c 20,10,40,30 "$gif" "$tmp/crop-" >"$tmp/crop.stdout"
+
+    if ! cmp -s "$tmp/full.stdout" "$tmp/crop.stdout" ; then
+        echo "Frame info mismatch"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    for out in "$tmp"/full-*.png; do
+        $convert "$out" -crop 40x30+20+10 +repage "$tmp/ref.png"
+        if ! compareimg "${out/full-/crop-}" "$tmp/ref.png" ; then
+            echo "Frame mismatch: ${out/full-/crop-}"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+    done
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Check the manifest of sprite sheets written to $tmp/$name-* against the
+# frames in $tmp/full-*.png: it must list every sheet that was written, and the
+# rectangle of every frame must hold that frame. Full size PNG sheets must
+# match exactly. JPEG or downsampled ones are compared on the background color,
+# against the frame scaled down to the rectangle, within a PSNR bound.
+checksprites() {
+    local tmp="$1" name="$2" ext="$3" exact="$4" frame=0 sheet x y w h out psnr
+    local sheets=$(ls "$tmp/$name"-*.$ext | wc -l)
+
+    if [ "$(grep '^  "sheets": ' "$tmp/$name.json")" != \
+         "  \"sheets\": [$(printf '"%s", ' "$tmp/$name"-*.$ext | \
+                           sed 's/, $//')]," ] ; then
+        echo "Sheet list mismatch in $name.json"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+    sed -n 's/^ *{"sheet": \([0-9]*\), "x": \([0-9]*\), "y": \([0-9]*\), "w": \([0-9]*\), "h": \([0-9]*\),.*/\1 \2 \3 \4 \5/p' \
+        "$tmp/$name.json" >"$tmp/$name.rects"
+    if [ "$(wc -l <"$tmp/$name.rects")" != "$(ls "$tmp"/full-*.png | wc -l)" ]
+    then
+        echo "Frame count mismatch in $name.json"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    while read sheet x y w h; do
+        out="$tmp/full-$(printf "%06d" $frame).png"
+        if [ "$sheet" -ge "$sheets" ] ; then
+            echo "Frame $frame is in missing sheet $sheet in $name.json"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        $convert "$tmp/$name-$(printf "%06d" $sheet).$ext" \
+            -crop "${w}x$h+$x+$y" +repage "$tmp/tile.png"
+        if [ "$exact" ] ; then
+            if ! compareimg "$out" "$tmp/tile.png" ; then
+                echo "Frame $frame mismatch in $name.json"
+                echo "Temp dir: $tmp"
+                return 1
+            fi
+        else
+            $convert "$out" -background white -flatten -scale "${w}x$h!" \
+                "$tmp/ref.png"
+            $convert "$tmp/tile.png" -background white -flatten "$tmp/tile.png"
+            psnr=$(compare -metric PSNR "$tmp/ref.png" "$tmp/tile.png" \
+                   null: 2>&1 || true)
+            if ! awk -v psnr="${psnr%% *}" \
+                 'BEGIN { exit !(psnr == "inf" || psnr + 0 >= 20) }' ; then
+                echo "Frame $frame too far off in $name.json ($psnr dB)"
+                echo "Temp dir: $tmp"
+                return 1
+            fi
+        fi
+        frame=$((frame + 1))
+    done <"$tmp/$name.rects"
+    return 0
+}
+
+# Pack the frames into sprite sheets: one frame per row, in an automatic grid
+# with repeated frames stored once, downsampled into three columns, and as JPEG
+# with optimized Huffman tables. Every frame's rectangle in the manifest must
+# hold that frame.
+testsprites() {
+    local gif="$1" tmp=$(mktemp -d)
+    echo -n "Testing sprite sheets on $gif... "
+
+    $gifsplit "$gif" "$tmp/full-" >/dev/null
+    $gifsplit -g 1 "$gif" "$tmp/rows-" >"$tmp/rows.json"
+    $gifsplit -g 0 -u "$gif" "$tmp/grid-" >"$tmp/grid.json"
+    $gifsplit -g 3 -z 2 "$gif" "$tmp/small-" >"$tmp/small.json"
+    $gifsplit -q 95 -o -g 1 "$gif" "$tmp/jpeg-" >"$tmp/jpeg.json"
+
+    checksprites "$tmp" rows png exact || return 1
+    checksprites "$tmp" grid png exact || return 1
+    checksprites "$tmp" small png || return 1
+    checksprites "$tmp" jpeg jpg || return 1
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# tc217 has 173 frames of 217x217, which do not fit in one column of 16384
+# pixels. They must be spread over three sheets, each one as tall as the frames
+# it holds.
+testmultisheet() {
+    local tmp=$(mktemp -d) sheet
+    echo -n "Testing sprite sheets over several files... "
+
+    $gifsplit testdata/tc217.gif "$tmp/full-" >/dev/null
+    $gifsplit -g 1 testdata/tc217.gif "$tmp/rows-" >"$tmp/rows.json"
+
+    for sheet in 0:75 1:75 2:23; do
+        if [ "$($convert "$tmp/rows-00000${sheet%:*}.png" -format "%w %h" \
+                info:)" != "217 $((${sheet#*:} * 217))" ] ; then
+            echo "Sheet ${sheet%:*} has the wrong size"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+    done
+    checksprites "$tmp" rows png exact || return 1
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Write the frames as y4m. The stream must have a header with the frame size,
+# one frame per info line and exactly the expected length.
+testraw() {
+    local gif="$1" tmp=$(mktemp -d) size w h header frames expected delay time
+    echo -n "Testing y4m output on $gif... "
+
+    $gifsplit "$gif" "$tmp/out-" >/dev/null
+    $gifsplit -r y4m -d "$tmp/info" -T "$tmp/times" "$gif" "$tmp/out.y4m"
+
+    size=$($convert "$tmp/out-000000.png" -format "%w %h" info:)
+    w=${size% *}
+    h=${size#* }
+    header=$(head -n 1 "$tmp/out.y4m")
+    if [ "${header% F*}" != "YUV4MPEG2 W$w H$h" ] ; then
+        echo "Bad header: $header"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    frames=$(grep -c delay= "$tmp/info")
+    if [ "$frames" != "$(ls "$tmp"/out-*.png | wc -l)" ] ; then
+        echo "Frame count mismatch"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+    expected=$(( ${#header} + 1 ))
+    time=0
+    echo "# timestamp format v2" > "$tmp/expected-times"
+    for delay in $(sed -n "s/^[0-9]* delay=//p" "$tmp/info"); do
+        expected=$(( expected + 6 +
+                     w * h + 2 * ((w + 1) / 2) * ((h + 1) / 2) ))
+        echo $time >> "$tmp/expected-times"
+        time=$(( time + 10 * (delay ? delay : 10) ))
+    done
+    if [ "$(stat -c %s "$tmp/out.y4m")" != "$expected" ] ; then
+        echo "Size mismatch: expected $expected bytes"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+    if ! cmp -s "$tmp/times" "$tmp/expected-times" ; then
+        echo "Timestamps mismatch"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Write every frame of a gif as JPEG at high and low quality, and with -o. All
+# frames share one compressor, so each of them must still decode and stay close
+# to the PNG frame rendered onto the white background. -o only changes the
+# Huffman tables, so it must not change a single pixel.
+testjpeg() {
+    local gif="$1" tmp=$(mktemp -d) png jpg q min psnr
+    echo -n "Testing JPEG output on $gif... "
+
+    $gifsplit "$gif" "$tmp/png-" >/dev/null
+    $gifsplit -q 95 "$gif" "$tmp/q95-" >/dev/null
+    $gifsplit -q 95 -o "$gif" "$tmp/opt-" >/dev/null
+    $gifsplit -q 30 "$gif" "$tmp/q30-" >/dev/null
+
+    if [ "$(ls "$tmp"/q95-*.jpg | wc -l)" != "$(ls "$tmp"/png-*.png | wc -l)" ]
+    then
+        echo "Frame count mismatch"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    for png in "$tmp"/png-*.png; do
+        jpg="${png%.png}.jpg"
+        if ! compareimg "${jpg/png-/q95-}" "${jpg/png-/opt-}" ; then
+            echo "Optimized frame mismatch: ${jpg/png-/opt-}"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        $convert "$png" -background white -flatten "$tmp/flat.png"
+        for q in 95:30 30:15; do
+            min=${q#*:}
+            q=${q%:*}
+            psnr=$(compare -metric PSNR "$tmp/flat.png" "${jpg/png-/q$q-}" \
+                   null: 2>&1 || true)
+            if ! awk -v psnr="${psnr%% *}" -v min=$min \
+                 'BEGIN { exit !(psnr == "inf" || psnr + 0 >= min) }' ; then
+                echo "Frame too far off at -q $q: ${jpg/png-/q$q-} ($psnr dB)"
+                echo "Temp dir: $tmp"
+                return 1
+            fi
+        done
+    done
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Write the frames in the background with one and four writers, through
+# io_uring where available and with the thread pool forced. The frame info and
+# every file must be the same as when writing synchronously.
+testwriter() {
+    local gif="$1" tmp=$(mktemp -d) run out
+    echo -n "Testing background writes on $gif... "
+
+    $gifsplit "$gif" "$tmp/sync-" >"$tmp/sync.txt"
+    for run in w1 w4 pool1 pool4; do
+        if [ "${run#pool}" != "$run" ] ; then
+            GIFSPLIT_NO_IO_URING=1 \
+                $gifsplit -w ${run#pool} "$gif" "$tmp/$run-" >"$tmp/$run.txt"
+        else
+            $gifsplit -w ${run#w} "$gif" "$tmp/$run-" >"$tmp/$run.txt"
+        fi
+        if ! cmp -s "$tmp/sync.txt" "$tmp/$run.txt" ; then
+            echo "Frame info mismatch with $run"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        if [ "$(ls "$tmp"/$run-*.png | wc -l)" != \
+             "$(ls "$tmp"/sync-*.png | wc -l)" ] ; then
+            echo "Frame count mismatch with $run"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        for out in "$tmp"/sync-*.png; do
+            if ! cmp -s "$out" "${out/sync-/$run-}" ; then
+                echo "Frame mismatch with $run: ${out/sync-/$run-}"
+                echo "Temp dir: $tmp"
+                return 1
+            fi
+        done
+    done
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Write a fully transparent 2x2 frame as y4m with -b. It must come out as just
+# the background color: one luma value for all four pixels, then one chroma
+# sample per plane.
+testbackground() {
+    local tmp=$(mktemp -d) r=18 g=52 b=86 y u v
+    echo -n "Testing y4m background color... "
+
+    y=$(( ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16 ))
+    u=$(( ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128 ))
+    v=$(( ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128 ))
+
+    $convert -size 2x2 xc:none "$tmp/clear.gif"
+    $gifsplit -r y4m -b "$(printf %02x%02x%02x $r $g $b)" "$tmp/clear.gif" \
+        "$tmp/clear.y4m" >/dev/null
+    if [ "$(tail -c 6 "$tmp/clear.y4m" | od -An -tx1 | tr -d ' \n')" \
+         != "$(printf %02x $y $y $y $y $u $v)" ] ; then
+        echo "Background color mismatch"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Crop tc217 to where its first two tiles meet. The frames are in truecolor
+# mode, but have no more than 256 colors, so they must be written as palette
+# PNGs (color type 3) that look the same as the truecolor frames.
+testexactpalette() {
+    local tmp=$(mktemp -d) out
+    echo -n "Testing truecolor frames with few colors... "
+
+    $gifsplit testdata/tc217.gif "$tmp/full-" >/dev/null
+    $gifsplit -c 8,0,16,16 testdata/tc217.gif "$tmp/crop-" >/dev/null
+
+    for out in "$tmp"/crop-00000[01].png; do
+        if [ "$(od -An -tu1 -j25 -N1 "$out" | tr -d ' ')" != "3" ] ; then
+            echo "Not a palette PNG: $out"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        $convert "${out/crop-/full-}" -crop 16x16+8+0 +repage "$tmp/ref.png"
+        if ! compareimg "$out" "$tmp/ref.png" ; then
+            echo "Frame mismatch: $out"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+    done
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Scale tc217 up to a canvas of over 10 megapixels. It must be refused
+# without -P, and with -P, keeping the canvas in temporary files must give the
+# same frames and frame info, with or without the other options that change
+# how frames are read, composed and written.
+testlargecanvas() {
+    local tmp=$(mktemp -d) out opts run
+    echo -n "Testing large canvases... "
+
+    $convert "testdata/tc217.gif[0-4]" -scale 1500% "$tmp/big.gif"
+    if $gifsplit "$tmp/big.gif" "$tmp/out-" >/dev/null 2>&1 ; then
+        echo "Canvas over the default limit accepted"
+        echo "Temp dir: $tmp"
+        return 1
+    fi
+
+    mkdir "$tmp/ref" "$tmp/tmp1" "$tmp/tmp2" "$tmp/spill"
+    $gifsplit -P 11000000 "$tmp/big.gif" "$tmp/ref/out-" >"$tmp/ref.stdout"
+    run=1
+    for opts in "-p 4" "-l -j 3 -w 2" ; do
+        $gifsplit -P 11000000 -t "$tmp/spill" $opts "$tmp/big.gif" \
+            "$tmp/tmp$run/out-" >"$tmp/tmp$run.stdout"
+        if ! cmp -s "$tmp/ref.stdout" "$tmp/tmp$run.stdout" ; then
+            echo "Frame info mismatch with $opts"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+        for out in "$tmp"/ref/out-*.png; do
+            if ! compareimg "$out" "${out/ref/tmp$run}" ; then
+                echo "Frame mismatch with $opts: ${out/ref/tmp$run}"
+                echo "Temp dir: $tmp"
+                return 1
+            fi
+        done
+        run=$((run + 1))
+    done
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
+# Compress a frame large enough for -p to kick in. The frames must look the
+# same as without it.
+testparallelpng() {
+    local tmp=$(mktemp -d) out
+    echo -n "Testing parallel PNG compression... "
+
+    $convert testdata/tc217.gif -scale 500% "$tmp/big.gif"
+    $gifsplit "$tmp/big.gif" "$tmp/lib-" >/dev/null
+    $gifsplit -p 4 "$tmp/big.gif" "$tmp/par-" >/dev/null
+
+    for out in "$tmp"/lib-*.png; do
+        if ! compareimg "$out" "${out/lib-/par-}" ; then
+            echo "Frame mismatch: ${out/lib-/par-}"
+            echo "Temp dir: $tmp"
+            return 1
+        fi
+    done
+
+    rm -rf "$tmp"
+    echo "OK"
+    return 0
+}
+
 for gif in testdata/*.gif; do
     testgif $gif
 done
+
+for gif in testdata/*.gif; do
+    testcrop $gif
+done
+
+for gif in testdata/*.gif; do
+    testsprites $gif
+done
+
+for gif in testdata/*.gif; do
+    testraw $gif
+done
+
+for gif in testdata/*.gif; do
+    testjpeg $gif
+done
+
+for gif in testdata/*.gif; do
+    testwriter $gif
+done
+
+testbackground
+testexactpalette
+testmultisheet
+
+RANDOM=1
+for gif in testdata/*.gif; do
+    testlzw $gif
+done
+
+for gif in testdata/*.gif; do
+    testparallel $gif
+done
+
+testparallelpng
+testlargecanvas
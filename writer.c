@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* Linked file slots are the newest feature used (5.17). Headers that have
+them also have sqe->file_index (5.15) and the open and close opcodes (5.6).
+Older headers fall back to the thread pool. */
+#ifdef IORING_FEAT_LINKED_FILE
+#define HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+/* Maximum number of files queued or being written at once */
+#define QUEUE_DEPTH 16
+
+typedef struct {
+    char *filename;
+    void *data;
+    size_t size;
+    int pending;                /* Outstanding io_uring operations */
+    bool failed;
+} writer_job;
+
+struct writer {
+    bool failed;
+    bool uring;                 /* Writing through io_uring */
+    writer_job jobs[QUEUE_DEPTH];
+
+    /* Serializes submissions, and protects the thread pool state */
+    pthread_mutex_t lock;
+
+    /* Thread pool: jobs form a circular queue */
+    pthread_t *threads;
+    int nthreads;
+    int head, queued;
+    int active;                 /* Jobs being written by a thread */
+    bool closing;
+    pthread_cond_t not_empty, not_full, idle;
+
+#ifdef HAVE_IO_URING
+    /* io_uring: job i writes through registered file slot i */
+    int ring_fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+#endif
+};
+
+static bool write_file(const char *filename, const void *data, size_t size)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+
+    const char *p = data;
+    while (size) {
+        ssize_t ret = write(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            close(fd);
+            return false;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return !close(fd);
+}
+
+/* Release a job's resources. Must be called with the lock held, if any. */
+static void finish_job(writer *w, writer_job *job)
+{
+    if (job->failed) {
+        fprintf(stderr, "Failed to write to %s\n", job->filename);
+        w->failed = true;
+    }
+    free(job->filename);
+    free(job->data);
+    memset(job, 0, sizeof(*job));
+}
+
+static void *writer_thread(void *arg)
+{
+    writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->queued && !w->closing)
+            pthread_cond_wait(&w->not_empty, &w->lock);
+        if (!w->queued)
+            break;
+
+        writer_job job = w->jobs[w->head];
+        w->head = (w->head + 1) % QUEUE_DEPTH;
+        w->queued--;
+        w->active++;
+        pthread_cond_signal(&w->not_full);
+        pthread_mutex_unlock(&w->lock);
+
+        job.failed = !write_file(job.filename, job.data, job.size);
+
+        pthread_mutex_lock(&w->lock);
+        finish_job(w, &job);
+        if (!--w->active && !w->queued)
+            pthread_cond_broadcast(&w->idle);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+#define OP_OPEN     0
+#define OP_WRITE    1
+#define OP_CLOSE    2
+
+static bool uring_setup(writer *w)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    w->ring_fd = syscall(__NR_io_uring_setup, 4 * QUEUE_DEPTH, &p);
+    if (w->ring_fd < 0)
+        return false;
+
+    /* Writes are linked to the open that creates their (registered) file,
+    which only works if the kernel defers the file lookup until then. */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_LINKED_FILE))
+        goto fail;
+
+    w->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > w->ring_size)
+        w->ring_size = cq_size;
+    w->ring = mmap(NULL, w->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   w->ring_fd, IORING_OFF_SQ_RING);
+    if (w->ring == MAP_FAILED)
+        goto fail;
+
+    w->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(NULL, w->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   w->ring_fd, IORING_OFF_SQES);
+    if (w->sqes == MAP_FAILED)
+        goto fail_ring;
+
+    char *ring = w->ring;
+    w->sq_head = (unsigned *)(ring + p.sq_off.head);
+    w->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    w->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    w->sq_array = (unsigned *)(ring + p.sq_off.array);
+    w->cq_head = (unsigned *)(ring + p.cq_off.head);
+    w->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    w->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    int files[QUEUE_DEPTH];
+    for (int i = 0; i < QUEUE_DEPTH; i++)
+        files[i] = -1;
+    if (syscall(__NR_io_uring_register, w->ring_fd, IORING_REGISTER_FILES,
+                files, QUEUE_DEPTH) < 0)
+        goto fail_sqes;
+
+    w->uring = true;
+    return true;
+
+fail_sqes:
+    munmap(w->sqes, w->sqes_size);
+fail_ring:
+    munmap(w->ring, w->ring_size);
+fail:
+    close(w->ring_fd);
+    w->ring_fd = -1;
+    return false;
+}
+
+static struct io_uring_sqe *uring_get_sqe(writer *w, int job, int op)
+{
+    /* The kernel consumes every submitted entry on io_uring_enter, and at
+    most 3 * QUEUE_DEPTH are ever unsubmitted, so there is always room. */
+    unsigned index = (*w->sq_tail + w->to_submit++) & *w->sq_mask;
+    struct io_uring_sqe *sqe = &w->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = job * 4 + op;
+    w->sq_array[index] = index;
+    return sqe;
+}
+
+static void uring_reap(writer *w)
+{
+    unsigned head = *w->cq_head;
+    unsigned tail = __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+        writer_job *job = &w->jobs[cqe->user_data / 4];
+
+        if (cqe->res < 0
+            || (cqe->user_data % 4 == OP_WRITE && (size_t)cqe->res != job->size))
+            job->failed = true;
+        if (!--job->pending)
+            finish_job(w, job);
+        head++;
+    }
+    __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit all queued entries, optionally waiting for at least one completion */
+static bool uring_enter(writer *w, bool wait)
+{
+    unsigned tail = *w->sq_tail + w->to_submit;
+    __atomic_store_n(w->sq_tail, tail, __ATOMIC_RELEASE);
+    w->to_submit = 0;
+
+    for (;;) {
+        /* Include anything a previous call failed to submit */
+        unsigned count = tail - __atomic_load_n(w->sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, w->ring_fd, count,
+                          wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                          NULL, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+        break;
+    }
+    uring_reap(w);
+    return true;
+}
+
+static bool uring_pending(writer *w)
+{
+    for (int i = 0; i < QUEUE_DEPTH; i++)
+        if (w->jobs[i].pending)
+            return true;
+    return false;
+}
+
+/* Queue the open, write and close for a file. Submission is deferred until
+the queue fills up, so that many small files go in a single system call. */
+static bool uring_submit(writer *w, writer_job *job)
+{
+    int slot;
+
+    for (;;) {
+        for (slot = 0; slot < QUEUE_DEPTH; slot++)
+            if (!w->jobs[slot].pending)
+                break;
+        if (slot < QUEUE_DEPTH)
+            break;
+        if (!uring_enter(w, true))
+            return false;
+    }
+
+    w->jobs[slot] = *job;
+    job = &w->jobs[slot];
+    job->pending = 3;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(w, slot, OP_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->filename;
+    sqe->len = 0666;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = slot + 1;
+
+    /* Hard link, so the file is closed even if the write fails */
+    sqe = uring_get_sqe(w, slot, OP_WRITE);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t)job->data;
+    sqe->len = job->size;
+    sqe->off = 0;
+
+    sqe = uring_get_sqe(w, slot, OP_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+
+    return true;
+}
+
+static void uring_flush(writer *w)
+{
+    while (w->to_submit || uring_pending(w)) {
+        if (!uring_enter(w, uring_pending(w))) {
+            /* Should not happen; give up on whatever is left */
+            for (int i = 0; i < QUEUE_DEPTH; i++) {
+                if (w->jobs[i].pending) {
+                    w->jobs[i].failed = true;
+                    finish_job(w, &w->jobs[i]);
+                }
+            }
+            break;
+        }
+    }
+}
+
+static void uring_close(writer *w)
+{
+    uring_flush(w);
+    munmap(w->sqes, w->sqes_size);
+    munmap(w->ring, w->ring_size);
+    close(w->ring_fd);
+}
+
+#endif
+
+writer *writer_open(int threads)
+{
+    writer *w = malloc(sizeof(writer));
+    if (!w)
+        return NULL;
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+
+    if (!threads)
+        return w;
+
+#ifdef HAVE_IO_URING
+    /* Setting GIFSPLIT_NO_IO_URING forces the thread pool, to test it or to
+    work around a broken io_uring */
+    if (!getenv("GIFSPLIT_NO_IO_URING") && uring_setup(w))
+        return w;
+#endif
+
+    pthread_cond_init(&w->not_empty, NULL);
+    pthread_cond_init(&w->not_full, NULL);
+    pthread_cond_init(&w->idle, NULL);
+    w->threads = malloc(threads * sizeof(pthread_t));
+    if (!w->threads) {
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+        return NULL;
+    }
+    for (; w->nthreads < threads; w->nthreads++) {
+        if (pthread_create(&w->threads[w->nthreads], NULL, writer_thread, w))
+            break;
+    }
+    if (!w->nthreads) {
+        free(w->threads);
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+bool writer_submit(writer *w, const char *filename, void *data, size_t size)
+{
+    bool sync = !w->uring && !w->nthreads;
+    writer_job job;
+    memset(&job, 0, sizeof(job));
+    job.filename = strdup(filename);
+    job.data = data;
+    job.size = size;
+    if (sync && job.filename)
+        job.failed = !write_file(filename, data, size);
+
+    pthread_mutex_lock(&w->lock);
+    if (!job.filename) {
+        fprintf(stderr, "Out of memory\n");
+        free(data);
+        w->failed = true;
+    } else if (job.failed || sync) {
+        finish_job(w, &job);
+    } else if (w->uring) {
+#ifdef HAVE_IO_URING
+        if (size > UINT32_MAX || !uring_submit(w, &job)) {
+            job.failed = true;
+            finish_job(w, &job);
+        }
+#endif
+    } else {
+        while (w->queued == QUEUE_DEPTH)
+            pthread_cond_wait(&w->not_full, &w->lock);
+        w->jobs[(w->head + w->queued) % QUEUE_DEPTH] = job;
+        w->queued++;
+        pthread_cond_signal(&w->not_empty);
+    }
+    bool ok = !w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+bool writer_flush(writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+#ifdef HAVE_IO_URING
+    if (w->uring)
+        uring_flush(w);
+#endif
+    while (w->queued || w->active)
+        pthread_cond_wait(&w->idle, &w->lock);
+    bool ok = !w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+bool writer_close(writer *w)
+{
+#ifdef HAVE_IO_URING
+    if (w->uring)
+        uring_close(w);
+#endif
+
+    if (w->nthreads) {
+        pthread_mutex_lock(&w->lock);
+        w->closing = true;
+        pthread_cond_broadcast(&w->not_empty);
+        pthread_mutex_unlock(&w->lock);
+        for (int i = 0; i < w->nthreads; i++)
+            pthread_join(w->threads[i], NULL);
+        free(w->threads);
+        pthread_cond_destroy(&w->not_empty);
+        pthread_cond_destroy(&w->not_full);
+        pthread_cond_destroy(&w->idle);
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    bool ok = !w->failed;
+    free(w);
+    return ok;
+}
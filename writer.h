@@ -0,0 +1,47 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Output file writer.
+ *
+ * Writes whole files from memory buffers, either synchronously or in the
+ * background so that encoding the next frame does not wait on the filesystem.
+ * Background writes go through io_uring where the kernel supports it, and
+ * through a pool of threads otherwise.
+ */
+typedef struct writer writer;
+
+/*
+ * Create a writer. threads is the number of background writer threads to use
+ * if io_uring is not available, or is disabled by setting the
+ * GIFSPLIT_NO_IO_URING environment variable; 0 means write synchronously.
+ */
+writer *writer_open(int threads);
+
+/*
+ * Write size bytes of data to a new file. The writer takes ownership of data,
+ * which must have been allocated with malloc. Returns false if this or any
+ * earlier write failed. May be called from several threads at once.
+ */
+bool writer_submit(writer *w, const char *filename, void *data, size_t size);
+
+/*
+ * Wait for all writes submitted so far to finish. Returns false if any write
+ * failed.
+ *
+ * The kernel cancels io_uring requests when the thread that submitted them
+ * exits, so a thread other than the one that closes the writer must call this
+ * before exiting if it submitted any writes.
+ */
+bool writer_flush(writer *w);
+
+/*
+ * Wait for all writes to finish and free the writer. Returns false if any
+ * write failed.
+ */
+bool writer_close(writer *w);
+
+#endif